@@ -0,0 +1,189 @@
+/*
+ * Created by YANHAI on 2020/1/23.
+ *
+ * auto_clean notification ring, client side for producers. Plain C, header only, no library.
+ *
+ * A producer that knows which files it writes tells auto_clean about them here instead of
+ * waiting for a scan to find them:
+ *
+ *     struct ac_ring ring;
+ *     if (ac_ring_open(&ring, "/dev/shm/auto_clean.cache") == 0) {
+ *         ...write the file, then before close(fd):
+ *         ac_ring_notify_fd(&ring, AC_RING_CLOSED, fd, path);
+ *     }
+ *
+ * The ring file is created by auto_clean for a clean entry with "ring: <path>". Notifying
+ * never blocks and never takes a lock: when the ring is full the record is dropped, counted
+ * in the header, and the file is found by the next rescan instead.
+ *
+ * Layout: struct ac_ring_header, then capacity (a power of two) struct ac_ring_record.
+ * Multiple producers, one consumer. A producer claims a ticket by a CAS on head, writes the
+ * record in slot ticket & (capacity - 1) and publishes it by storing seq = ticket + 1.
+ * The consumer reads slot tail while its seq is tail + 1 and gives it back for the next lap
+ * by storing seq = tail + capacity. A slot is free for ticket t when its seq is t.
+ */
+
+#ifndef AUTO_CLEAN_RING_H
+#define AUTO_CLEAN_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define AC_RING_MAGIC       0x41435247u     /* "ACRG" */
+#define AC_RING_VERSION     1
+#define AC_RING_PATH_MAX    456
+
+/* record types */
+#define AC_RING_CREATED     1   /* file created, still being written */
+#define AC_RING_CLOSED      2   /* file complete, size and mtime are final */
+#define AC_RING_REMOVED     3   /* file deleted by the producer, needs dev and ino */
+
+struct ac_ring_header {
+    uint32_t magic;             /* stored last when the ring is ready */
+    uint32_t version;
+    uint32_t capacity;          /* records, power of two */
+    uint32_t record_size;       /* sizeof(struct ac_ring_record) */
+    uint64_t dropped;           /* records lost because the ring was full */
+    char pad0[40];
+    uint64_t head;              /* next ticket, written by producers */
+    char pad1[56];
+    uint64_t tail;              /* next ticket to read, written by the consumer */
+    char pad2[56];
+};
+
+struct ac_ring_record {
+    uint64_t seq;
+    uint32_t type;
+    uint32_t path_len;          /* without the terminating NUL */
+    uint64_t dev;               /* st_dev and st_ino, 0 to let auto_clean stat the path */
+    uint64_t ino;
+    int64_t size;
+    int64_t blocks;             /* st_blocks, 512 byte units */
+    int64_t mtime;
+    char path[AC_RING_PATH_MAX];    /* absolute */
+};
+
+struct ac_ring {
+    struct ac_ring_header *header;
+    struct ac_ring_record *records;
+    size_t length;
+};
+
+static inline size_t ac_ring_length(uint32_t capacity)
+{
+    return sizeof(struct ac_ring_header) + (size_t) capacity * sizeof(struct ac_ring_record);
+}
+
+/**
+ * \brief Map the ring created by auto_clean
+ * \retval 0 on success, -1 with errno set (EAGAIN: not initialized yet, EPROTO: other version)
+ */
+static inline int ac_ring_open(struct ac_ring *ring, const char *path)
+{
+    struct stat st;
+    struct ac_ring_header *header;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct ac_ring_header)) {
+        close(fd);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    header = (struct ac_ring_header *) mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+        return -1;
+
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != AC_RING_MAGIC ||
+        header->version != AC_RING_VERSION || header->record_size != sizeof(struct ac_ring_record) ||
+        ac_ring_length(header->capacity) != (size_t) st.st_size) {
+        errno = header->magic == AC_RING_MAGIC ? EPROTO : EAGAIN;
+        munmap(header, (size_t) st.st_size);
+        return -1;
+    }
+
+    ring->header = header;
+    ring->records = (struct ac_ring_record *) (header + 1);
+    ring->length = (size_t) st.st_size;
+    return 0;
+}
+
+static inline void ac_ring_close(struct ac_ring *ring)
+{
+    if (ring->header)
+        munmap(ring->header, ring->length);
+    ring->header = NULL;
+    ring->records = NULL;
+}
+
+/**
+ * \brief Append a record, lock free
+ * \retval 0 on success, -1 with errno set (EAGAIN: ring full, ENAMETOOLONG, EINVAL)
+ */
+static inline int ac_ring_notify(struct ac_ring *ring, uint32_t type, const char *path, uint64_t dev, uint64_t ino,
+                                 int64_t size, int64_t blocks, int64_t mtime)
+{
+    struct ac_ring_header *header = ring->header;
+    struct ac_ring_record *record;
+    size_t len = strlen(path);
+    uint64_t mask = header->capacity - 1;
+    uint64_t pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+
+    if (path[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len >= AC_RING_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (;;) {
+        record = &ring->records[pos & mask];
+        int64_t diff = (int64_t) (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&header->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->type = type;
+    record->path_len = (uint32_t) len;
+    record->dev = dev;
+    record->ino = ino;
+    record->size = size;
+    record->blocks = blocks;
+    record->mtime = mtime;
+    memcpy(record->path, path, len + 1);
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * \brief Append a record for an open file, dev, ino, size and mtime from fstat
+ */
+static inline int ac_ring_notify_fd(struct ac_ring *ring, uint32_t type, int fd, const char *path)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+    return ac_ring_notify(ring, type, path, (uint64_t) st.st_dev, (uint64_t) st.st_ino, (int64_t) st.st_size,
+                          (int64_t) st.st_blocks, (int64_t) st.st_mtime);
+}
+
+#endif /* AUTO_CLEAN_RING_H */
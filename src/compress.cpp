@@ -0,0 +1,317 @@
+//
+// Created by YANHAI on 2020/1/8.
+//
+
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "util/log.h"
+
+using namespace std;
+
+Compressor::Compressor(const string &name, unsigned int threads, unsigned int queue_size, int level)
+        : name(name), threads(threads), queue_size(queue_size), level(level)
+{
+    if (this->threads == 0)
+        this->threads = 1;
+    if (this->queue_size < this->threads)
+        this->queue_size = this->threads;
+
+    stopping = false;
+    running = 0;
+    c_file = 0;
+    c_failed = 0;
+    c_bytes_in = 0;
+    c_bytes_out = 0;
+    c_usec = 0;
+    MutexInit(&mutex, nullptr);
+    CondInit(&cond, nullptr);
+}
+
+Compressor::~Compressor()
+{
+    stop();
+    CondDestroy(&cond);
+    MutexDestroy(&mutex);
+}
+
+bool Compressor::available()
+{
+#ifdef HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+int Compressor::start()
+{
+    if (!available()) {
+        spdlog::error("{}: built without zstd, can not compress", name);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_t t;
+        int rc = pthread_create(&t, nullptr, loop, this);
+        if (rc) {
+            spdlog::error("{}: create compress thread failed: {}", name, strerror(rc));
+            break;
+        }
+        tids.push_back(t);
+    }
+
+    return tids.empty() ? -1 : 0;
+}
+
+void Compressor::stop()
+{
+    MutexLock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    MutexUnlock(&mutex);
+
+    for (auto t: tids)
+        pthread_join(t, nullptr);
+    tids.clear();
+
+    // 没有开始的任务作为失败返回, 文件仍然留在原处
+    MutexLock(&mutex);
+    finished.splice(finished.end(), pending);
+    MutexUnlock(&mutex);
+}
+
+bool Compressor::full()
+{
+    MutexLock(&mutex);
+    bool r = pending.size() + running >= queue_size;
+    MutexUnlock(&mutex);
+    return r;
+}
+
+bool Compressor::submit(const string &path, time_t mtime, off_t size)
+{
+    MutexLock(&mutex);
+    if (stopping || tids.empty() || pending.size() + running >= queue_size) {
+        MutexUnlock(&mutex);
+        return false;
+    }
+    // 重新扫描时压缩中的原文件会再次出现在队列中
+    if (!active.insert(path).second) {
+        MutexUnlock(&mutex);
+        return true;
+    }
+    pending.push_back(Job{path, mtime, size, "", 0, false});
+    CondSignal(&cond);
+    MutexUnlock(&mutex);
+    return true;
+}
+
+void Compressor::done(list<Job> &jobs)
+{
+    MutexLock(&mutex);
+    for (auto &job: finished)
+        active.erase(job.path);
+    jobs.splice(jobs.end(), finished);
+    MutexUnlock(&mutex);
+}
+
+void *Compressor::loop(void *arg)
+{
+    auto c = (Compressor *) arg;
+    void *cctx = nullptr;
+
+    string thread_name = ("Zstd#" + c->name).substr(0, THREAD_NAME_LEN);
+    SetThreadName(thread_name.c_str());
+
+#ifdef HAVE_ZSTD
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter((ZSTD_CCtx *) cctx, ZSTD_c_compressionLevel, c->level);
+#endif
+
+    MutexLock(&c->mutex);
+    while (true) {
+        while (c->pending.empty() && !c->stopping)
+            CondWait(&c->cond, &c->mutex);
+        if (c->stopping)
+            break;
+
+        list<Job> job;
+        job.splice(job.end(), c->pending, c->pending.begin());
+        c->running++;
+        MutexUnlock(&c->mutex);
+
+        job.front().ok = c->compress(job.front(), cctx);
+
+        MutexLock(&c->mutex);
+        c->running--;
+        c->finished.splice(c->finished.end(), job);
+    }
+    MutexUnlock(&c->mutex);
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *) cctx);
+#endif
+    return nullptr;
+}
+
+/**
+ * 压缩到 path.zst.tmp, fsync 后 rename 为 path.zst, 最后删除原文件
+ */
+bool Compressor::compress(Job &job, void *cctx)
+{
+#ifdef HAVE_ZSTD
+    struct stat st;
+    struct timeval begin, end;
+    bool ok = false;
+    int out_fd = -1;
+    bool created = false;   // tmp exists and has to be removed on failure
+
+    gettimeofday(&begin, nullptr);
+    job.target = job.path + COMPRESS_SUFFIX;
+    auto tmp = job.path + COMPRESS_TMP_SUFFIX;
+
+    int in_fd = open(job.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in_fd < 0 || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        spdlog::debug("{}: open {} failed: {}", name, job.path, strerror(errno));
+        goto out;
+    }
+
+    // 扫描后被修改过, 可能还在写
+    if (st.st_mtime != job.mtime) {
+        spdlog::debug("{}: {} modified after scan, skip", name, job.path);
+        goto out;
+    }
+
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    out_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 07777);
+    if (out_fd < 0) {
+        spdlog::warn("{}: create {} failed: {}", name, tmp, strerror(errno));
+        goto out;
+    }
+    created = true;
+
+    {
+        ZSTD_CCtx_reset((ZSTD_CCtx *) cctx, ZSTD_reset_session_only);
+        ZSTD_CCtx_setPledgedSrcSize((ZSTD_CCtx *) cctx, st.st_size);
+
+        // 按块 pread, 压缩中被截断(生产者, reaper)时读到的数据不足, 任务失败
+        vector<char> in(ZSTD_CStreamInSize());
+        vector<char> buffer(ZSTD_CStreamOutSize());
+        off_t offset = 0;
+        size_t remaining;
+        do {
+            ssize_t len = 0;
+            if (offset < st.st_size) {
+                len = pread(in_fd, in.data(), (size_t) std::min((off_t) in.size(), st.st_size - offset), offset);
+                if (len < 0 && errno == EINTR)
+                    continue;
+                if (len <= 0) {
+                    spdlog::warn("{}: read {} failed: {}", name, job.path, len < 0 ? strerror(errno) : "truncated");
+                    goto out;
+                }
+                offset += len;
+            }
+            auto mode = offset < st.st_size ? ZSTD_e_continue : ZSTD_e_end;
+            ZSTD_inBuffer input = {in.data(), (size_t) len, 0};
+            do {
+                ZSTD_outBuffer output = {buffer.data(), buffer.size(), 0};
+                remaining = ZSTD_compressStream2((ZSTD_CCtx *) cctx, &output, &input, mode);
+                if (ZSTD_isError(remaining)) {
+                    spdlog::warn("{}: compress {} failed: {}", name, job.path, ZSTD_getErrorName(remaining));
+                    goto out;
+                }
+                for (size_t pos = 0; pos < output.pos;) {
+                    ssize_t n = write(out_fd, buffer.data() + pos, output.pos - pos);
+                    if (n < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        spdlog::warn("{}: write {} failed: {}", name, tmp, strerror(errno));
+                        goto out;
+                    }
+                    pos += n;
+                    job.target_size += n;
+                }
+            } while (mode == ZSTD_e_end ? remaining != 0 : input.pos < input.size);
+        } while (offset < st.st_size);
+    }
+
+    {
+        // 保留原文件的时间, 压缩后的文件仍然按原来的时间排序
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        futimens(out_fd, times);
+    }
+
+    if (fsync(out_fd) != 0) {
+        spdlog::warn("{}: fsync {} failed: {}", name, tmp, strerror(errno));
+        goto out;
+    }
+    close(out_fd);
+    out_fd = -1;
+
+    if (rename(tmp.c_str(), job.target.c_str()) != 0) {
+        spdlog::warn("{}: rename {} failed: {}", name, tmp, strerror(errno));
+        goto out;
+    }
+    created = false;
+
+    {
+        // rename 也要落盘, 否则掉电后可能压缩文件和原文件都不存在
+        vector<char> dir(job.target.begin(), job.target.end());
+        dir.push_back('\0');
+        int dir_fd = open(dirname(dir.data()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    if (unlink(job.path.c_str()) != 0)
+        spdlog::warn("{}: unlink {} failed: {}", name, job.path, strerror(errno));
+
+    ok = true;
+    gettimeofday(&end, nullptr);
+    c_file += 1;
+    c_bytes_in += st.st_size;
+    c_bytes_out += job.target_size;
+    c_usec += (end.tv_sec - begin.tv_sec) * 1000000ULL + end.tv_usec - begin.tv_usec;
+    spdlog::info("compress file: {} [{} -> {}]", job.path, st.st_size, job.target_size);
+
+out:
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0)
+        close(out_fd);
+    if (created)
+        unlink(tmp.c_str());
+    if (!ok)
+        c_failed += 1;
+    return ok;
+#else
+    (void) job;
+    (void) cctx;
+    return false;
+#endif
+}
+
+void Compressor::printStats()
+{
+    unsigned long long usec = c_usec;
+    unsigned long long bytes_in = c_bytes_in;
+    unsigned long long bytes_out = c_bytes_out;
+
+    spdlog::info("{}: compressed {} files ({} failed), {} -> {} bytes, ratio {:.2f}, {:.1f} MB/s per thread",
+                 name, (unsigned long) c_file, (unsigned long) c_failed, bytes_in, bytes_out,
+                 bytes_out ? bytes_in * 1.0 / bytes_out : 0.0,
+                 usec ? bytes_in * 1.0 / usec : 0.0);
+}
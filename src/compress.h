@@ -0,0 +1,100 @@
+//
+// Created by YANHAI on 2020/1/8.
+//
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <set>
+#include <string>
+#include <vector>
+#include "util-threads.h"
+
+#define COMPRESS_SUFFIX ".zst"
+#define COMPRESS_TMP_SUFFIX ".zst.tmp"     // being written, or left by a crash; never compressed
+
+/**
+ * \brief Bounded multi-threaded zstd compression pipeline of a clean entry
+ *
+ * Files are compressed into a sibling .zst (input read with pread, a file truncated meanwhile fails
+ * the job instead of faulting the process), the .zst keeps the mtime of the original and is fsynced
+ * and renamed into place before the original is unlinked.
+ * Results are handed back to the owner thread by done().
+ */
+class Compressor {
+public:
+    struct Job {
+        string path;
+        time_t mtime;
+        off_t size;
+
+        // result
+        string target;
+        off_t target_size;
+        bool ok;
+    };
+
+    Compressor(const string &name, unsigned int threads, unsigned int queue_size, int level);
+
+    ~Compressor();
+
+    /**
+     * \brief Built with zstd support or not
+     */
+    static bool available();
+
+    int start();
+
+    void stop();
+
+    /**
+     * \brief Queue a file, never blocks
+     *
+     * \retval false if the pipeline is full
+     * \note a file already queued and not taken back by done() yet is not queued again
+     */
+    bool submit(const string &path, time_t mtime, off_t size);
+
+    /**
+     * \brief Take the finished jobs
+     */
+    void done(list<Job> &jobs);
+
+    bool full();
+
+    bool match(unsigned int threads, unsigned int queue_size, int level) const
+    {
+        return this->threads == threads && this->queue_size == queue_size && this->level == level;
+    }
+
+    void printStats();
+
+private:
+    static void *loop(void *arg);
+
+    bool compress(Job &job, void *cctx);
+
+private:
+    string name;
+    unsigned int threads;
+    unsigned int queue_size;
+    int level;
+
+    vector<pthread_t> tids;
+    bool stopping;
+
+    Mutex mutex;
+    CondT cond;
+    list<Job> pending;
+    list<Job> finished;
+    unsigned int running;
+    set<string> active;     // paths submitted and not taken by done() yet
+
+    // stats
+    atomic<unsigned long> c_file;
+    atomic<unsigned long> c_failed;
+    atomic<unsigned long long> c_bytes_in;
+    atomic<unsigned long long> c_bytes_out;
+    atomic<unsigned long long> c_usec;
+};
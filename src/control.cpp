@@ -0,0 +1,514 @@
+//
+// Created by YANHAI on 2020/1/10.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control.h"
+#include "worker.h"
+#include "util/config.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define CONTROL_LINE_MAX    4096
+#define CONTROL_TIMEOUT_MS  1000    // to read the request line
+#define CONTROL_CLIENTS_MAX 64      // clients reading their request line, more wait in the listen queue
+#define CONTROL_PLAN_WAIT_MS 1000   // a plan query waits for the worker to build the plan
+#define CONTROL_REPLY_MS    100     // to flush the response, the client is dropped after that
+#define RESERVE_TIMEOUT_MS  10000
+
+void Reservation::complete(int result, off_t free, const string &msg)
+{
+    int expected = RESERVE_PENDING;
+
+    // 先写结果, 再修改状态
+    free_bytes = free;
+    message = msg;
+    if (state.compare_exchange_strong(expected, result)) {
+        uint64_t one = 1;
+        if (write(notify_fd, &one, sizeof(one)) < 0)
+            spdlog::warn("notify control thread failed: {}", strerror(errno));
+    }
+}
+
+static long timespec_diff_ms(const struct timespec &a, const struct timespec &b)
+{
+    return (a.tv_sec - b.tv_sec) * 1000 + (a.tv_nsec - b.tv_nsec) / 1000000;
+}
+
+/**
+ * CLOCK_MONOTONIC, ms 之后
+ */
+static struct timespec deadline_after(long ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+Control::Control()
+{
+    name = "Control";
+    sleep = 0;
+    listen_fd = -1;
+    notify_fd = -1;
+    path = socket_path();
+}
+
+Control::~Control()
+{
+    Worker::set_plan_notify(-1);
+    for (auto &r: reservations)
+        close(r->client_fd);
+    for (auto &q: plans)
+        close(q.client_fd);
+    for (auto &it: clients)
+        close(it.first);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+    if (notify_fd >= 0)
+        close(notify_fd);
+}
+
+string Control::socket_path()
+{
+    auto &socket = Config::instance()["control"]["socket"];
+    return socket.isString() ? socket.asString() : DEFAULT_CONTROL_SOCKET;
+}
+
+int Control::init()
+{
+    struct sockaddr_un addr;
+
+    if (path.length() >= sizeof(addr.sun_path)) {
+        spdlog::error("control socket path {} is too long", path);
+        return 0;
+    }
+
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0) {
+        spdlog::error("create control eventfd failed: {}", strerror(errno));
+        return 0;
+    }
+    Worker::set_plan_notify(notify_fd);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        spdlog::error("create control socket failed: {}", strerror(errno));
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+        spdlog::error("bind control socket {} failed: {}", path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return 0;
+    }
+    chmod(path.c_str(), 0660);
+
+    spdlog::info("control socket listen on {}", path);
+    return 0;
+}
+
+int Control::loop()
+{
+    if (listen_fd < 0)
+        return -1;
+
+    vector<struct pollfd> pfds;
+    while (!checkFlag(THV_KILL)) {
+        // 每个客户端都在 poll 中等待请求行, 一个不发送的客户端不影响其他客户端和预留的回复.
+        // 客户端太多时暂停 accept, 新的连接留在 listen 队列中
+        pfds.clear();
+        pfds.push_back({notify_fd, POLLIN, 0});
+        pfds.push_back({wakeupFd(), POLLIN, 0});
+        pfds.push_back({clients.size() < CONTROL_CLIENTS_MAX ? listen_fd : -1, POLLIN, 0});
+        for (auto &it: clients)
+            pfds.push_back({it.first, POLLIN, 0});
+
+        int r = poll(pfds.data(), pfds.size(), poll_timeout());
+        if (r > 0 && (pfds[0].revents & POLLIN)) {
+            uint64_t n;
+            if (read(notify_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                spdlog::warn("read control eventfd failed: {}", strerror(errno));
+        }
+        if (r > 0 && (pfds[1].revents & POLLIN)) {
+            uint64_t n;
+            if (read(wakeupFd(), &n, sizeof(n)) < 0 && errno != EAGAIN)
+                spdlog::warn("read control wakeup eventfd failed: {}", strerror(errno));
+        }
+        check_reservations();
+        check_plans();
+        for (size_t i = 3; r > 0 && i < pfds.size(); i++) {
+            if (pfds[i].revents)
+                read_client(pfds[i].fd);
+        }
+        check_clients();
+        if (r > 0 && (pfds[2].revents & POLLIN))
+            accept_clients();
+    }
+    return 0;
+}
+
+/**
+ * 等到最近的 deadline(预留请求, plan 查询, 没有读完请求行的客户端), 否则一直等待, 停止线程时 wakeupFd 可读
+ */
+int Control::poll_timeout()
+{
+    long timeout = -1;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    auto until = [&](const struct timespec &deadline) {
+        long left = std::max(0L, timespec_diff_ms(deadline, now) + 1);
+        if (timeout < 0 || left < timeout)
+            timeout = left;
+    };
+    for (auto &r: reservations)
+        until(r->deadline);
+    for (auto &q: plans)
+        until(q.deadline);
+    for (auto &it: clients)
+        until(it.second.deadline);
+    return (int) timeout;
+}
+
+/**
+ * 回复已完成或已超时的预留请求
+ */
+void Control::check_reservations()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto it = reservations.begin(); it != reservations.end();) {
+        auto &r = *it;
+        int expected = RESERVE_PENDING;
+        if (timespec_diff_ms(r->deadline, now) <= 0)
+            r->state.compare_exchange_strong(expected, RESERVE_EXPIRED);
+
+        int state = r->state;
+        if (state == RESERVE_PENDING) {
+            ++it;
+            continue;
+        }
+
+        Json::Value response;
+        if (state == RESERVE_DONE) {
+            response["status"] = "ok";
+            response["free"] = (Json::Int64) r->free_bytes;
+        } else {
+            response["status"] = "error";
+            response["message"] = state == RESERVE_EXPIRED ? "deadline exceeded" : r->message;
+            if (state == RESERVE_FAILED)
+                response["free"] = (Json::Int64) r->free_bytes;
+        }
+        reply(r->client_fd, response);
+        close(r->client_fd);
+        it = reservations.erase(it);
+    }
+}
+
+void Control::accept_clients()
+{
+    int fd;
+    while (clients.size() < CONTROL_CLIENTS_MAX &&
+           (fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        clients[fd].deadline = deadline_after(CONTROL_TIMEOUT_MS);
+        read_client(fd);    // 请求通常已经到达
+    }
+}
+
+/**
+ * 读取已经到达的数据, 请求行完整(或客户端关闭)时处理, 否则在下次 poll 时继续
+ */
+void Control::read_client(int fd)
+{
+    auto it = clients.find(fd);
+    if (it == clients.end())
+        return;
+
+    auto &line = it->second.line;
+    char buf[512];
+    while (line.find('\n') == string::npos && line.length() < CONTROL_LINE_MAX) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+            break;
+        line.append(buf, n);
+    }
+
+    auto request = line.substr(0, line.find('\n'));
+    clients.erase(it);
+    handle(fd, request);
+}
+
+/**
+ * 到 deadline 还没有发送完整请求行的客户端直接关闭
+ */
+void Control::check_clients()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto it = clients.begin(); it != clients.end();) {
+        if (timespec_diff_ms(it->second.deadline, now) > 0) {
+            ++it;
+            continue;
+        }
+        spdlog::debug("control client timed out, {} bytes read", it->second.line.length());
+        close(it->first);
+        it = clients.erase(it);
+    }
+}
+
+/**
+ * 回复 plan 已经构建或者等待超时的查询
+ */
+void Control::check_plans()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto it = plans.begin(); it != plans.end();) {
+        auto &q = *it;
+        bool built = Worker::plan_built(q.path, q.builds);
+        if (!built && timespec_diff_ms(q.deadline, now) > 0) {
+            ++it;
+            continue;
+        }
+
+        Json::Value response;
+        answer_plan(q.path, q.bytes, q.age, built, response);
+        reply(q.client_fd, response);
+        close(q.client_fd);
+        it = plans.erase(it);
+    }
+}
+
+void Control::answer_plan(const string &prefix, off_t bytes, unsigned long age, bool ready, Json::Value &response)
+{
+    if (!Worker::plan(prefix, bytes, age, ready, response["result"])) {
+        response.removeMember("result");
+        response["status"] = "error";
+        response["message"] = "path " + prefix + " is not watched";
+        return;
+    }
+    response["status"] = "ok";
+}
+
+/**
+ * 处理一行请求, 返回一行 json
+ */
+void Control::handle(int fd, const string &line)
+{
+    Json::Value response;
+    if (!dispatch(fd, line, response))
+        return;     // 异步回复
+
+    reply(fd, response);
+    close(fd);
+}
+
+void Control::reply(int fd, const Json::Value &response)
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    auto out = Json::writeString(builder, response) + "\n";
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t pos = 0; pos < out.length();) {
+        ssize_t n = send(fd, out.data() + pos, out.length() - pos, MSG_NOSIGNAL);
+        if (n > 0) {
+            pos += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        // 客户端不读取, 缓冲区满时最多等 CONTROL_REPLY_MS, 之后丢弃这个客户端
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = CONTROL_REPLY_MS - timespec_diff_ms(now, start);
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if (n == 0 || errno != EAGAIN || left <= 0 || poll(&pfd, 1, (int) left) <= 0) {
+            spdlog::debug("control client dropped, {} of {} bytes sent", pos, out.length());
+            break;
+        }
+    }
+}
+
+/**
+ * \retval false if the response is sent later
+ */
+bool Control::dispatch(int fd, const string &line, Json::Value &response)
+{
+    istringstream is(line);
+    string cmd;
+    is >> cmd;
+
+    if (cmd == "reserve") {
+        string bytes, prefix;
+        long timeout = RESERVE_TIMEOUT_MS;
+        is >> bytes >> prefix >> timeout;
+
+        Json::UInt64 size = 0;
+        if (!Config::size_string_to_uint64(bytes, size) || size > (Json::UInt64) INT64_MAX) {
+            response["status"] = "error";
+            response["message"] = "invalid size: " + bytes;
+            return true;
+        }
+
+        auto r = make_shared<Reservation>();
+        r->path = prefix;
+        r->bytes = (off_t) size;
+        r->client_fd = fd;
+        r->notify_fd = notify_fd;
+        r->state = RESERVE_PENDING;
+        r->free_bytes = 0;
+        r->deadline = deadline_after(timeout);
+
+        if (r->bytes <= 0 || prefix.empty()) {
+            response["status"] = "error";
+            response["message"] = "usage: reserve <bytes> <path> [timeout_ms]";
+            return true;
+        }
+        if (!Worker::reserve(r)) {
+            response["status"] = "error";
+            response["message"] = "path " + prefix + " is not watched";
+            return true;
+        }
+        reservations.push_back(r);
+        return false;
+    }
+
+    if (cmd == "du") {
+        string prefix;
+        unsigned int depth = 0;
+        is >> prefix >> depth;
+        while (prefix.length() > 1 && prefix[prefix.length() - 1] == '/')
+            prefix.erase(prefix.length() - 1);
+        if (prefix.empty() || !Worker::du(prefix, depth, response["result"])) {
+            response["status"] = "error";
+            response["message"] = "path " + prefix + " is not watched";
+            return true;
+        }
+        response["status"] = "ok";
+        return true;
+    }
+
+    if (cmd == "plan") {
+        string prefix;
+        string bytes;
+        unsigned long age = 0;
+        is >> prefix >> bytes >> age;
+        while (prefix.length() > 1 && prefix[prefix.length() - 1] == '/')
+            prefix.erase(prefix.length() - 1);
+        Json::UInt64 size = 0;
+        if (!Config::size_string_to_uint64(bytes, size) || size > (Json::UInt64) INT64_MAX) {
+            response["status"] = "error";
+            response["message"] = "invalid size: " + bytes;
+            return true;
+        }
+        bool wait = false;
+        unsigned long builds = 0;
+        if (prefix.empty() || !Worker::plan_request(prefix, wait, builds)) {
+            response["status"] = "error";
+            response["message"] = "path " + prefix + " is not watched";
+            return true;
+        }
+        if (wait) {
+            // worker 构建后通过 notify_fd 唤醒, 最多等 CONTROL_PLAN_WAIT_MS
+            plans.push_back(PlanQuery{fd, prefix, (off_t) size, age, builds, deadline_after(CONTROL_PLAN_WAIT_MS)});
+            return false;
+        }
+        answer_plan(prefix, (off_t) size, age, true, response);
+        return true;
+    }
+
+    if (cmd == "ballast") {
+        Ballast::status(response["result"]);
+        response["status"] = "ok";
+        return true;
+    }
+
+    response["status"] = "error";
+    response["message"] = "unknown command: " + cmd;
+    return true;
+}
+
+bool Control::request(const string &line, Json::Value &response)
+{
+    struct sockaddr_un addr;
+    auto path = socket_path();
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        spdlog::error("connect to {} failed: {}", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    auto out = line + "\n";
+    if (write(fd, out.data(), out.length()) != (ssize_t) out.length()) {
+        close(fd);
+        return false;
+    }
+
+    string in;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        in.append(buf, n);
+    close(fd);
+
+    Json::CharReaderBuilder builder;
+    JSONCPP_STRING errs;
+    istringstream is(in);
+    return parseFromStream(builder, is, &response, &errs);
+}
+
+void Control::exitPrintStats()
+{
+}
+
+int Control::deinit()
+{
+    return 0;
+}
+
+ThreadVars *Control::create()
+{
+    return new Control;
+}
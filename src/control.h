@@ -0,0 +1,123 @@
+//
+// Created by YANHAI on 2020/1/10.
+//
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <json/json.h>
+#include "util-threads.h"
+
+#define RESERVE_PENDING     0
+#define RESERVE_DONE        1
+#define RESERVE_FAILED      2
+#define RESERVE_EXPIRED     3
+
+/**
+ * \brief A producer asks for free space on the mount of path
+ *
+ * Completed by the worker watching path, or expired by the control thread at the deadline,
+ * whichever changes state from RESERVE_PENDING first.
+ */
+struct Reservation {
+    string path;
+    off_t bytes;
+    struct timespec deadline;   // CLOCK_MONOTONIC
+    int client_fd;
+    int notify_fd;              // eventfd of the control thread
+
+    atomic<int> state;
+    off_t free_bytes;           // valid after state changed
+    string message;
+
+    /**
+     * \brief Called by the worker, ignored if the reservation already expired
+     */
+    void complete(int result, off_t free, const string &msg);
+};
+
+/**
+ * \brief A client of the control socket until its request line is read
+ */
+struct ControlClient {
+    string line;
+    struct timespec deadline;   // CLOCK_MONOTONIC, closed if the line is not complete by then
+};
+
+/**
+ * \brief A plan query waiting for the worker to build the plan
+ */
+struct PlanQuery {
+    int client_fd;
+    string path;
+    off_t bytes;
+    unsigned long age;
+    unsigned long builds;       // plans built by the worker when asked
+    struct timespec deadline;   // CLOCK_MONOTONIC, answered from the last snapshot after it
+};
+
+/**
+ * \brief Local control socket (unix stream socket, one request line, one json response line)
+ *
+ *   du <path> [depth]                       directory sizes from the in-memory index
+ *   reserve <bytes> <path> [timeout_ms]     evict until the mount of path has bytes free
+ */
+class Control : public ThreadVars {
+protected:
+    Control();
+
+public:
+    ~Control();
+
+    virtual int init();
+
+    virtual int loop();
+
+    virtual void exitPrintStats();
+
+    virtual int deinit();
+
+    static ThreadVars *create();
+
+    static string socket_path();
+
+    /**
+     * \brief Client side, send one request and wait for the response
+     *
+     * \retval false on connect or io error
+     */
+    static bool request(const string &line, Json::Value &response);
+
+private:
+    void accept_clients();
+
+    void read_client(int fd);
+
+    void check_clients();
+
+    void handle(int fd, const string &line);
+
+    bool dispatch(int fd, const string &line, Json::Value &response);
+
+    void reply(int fd, const Json::Value &response);
+
+    void check_reservations();
+
+    void check_plans();
+
+    void answer_plan(const string &prefix, off_t bytes, unsigned long age, bool ready, Json::Value &response);
+
+    int poll_timeout();
+
+private:
+    string path;
+    int listen_fd;
+    int notify_fd;
+    list<shared_ptr<Reservation>> reservations;
+    list<PlanQuery> plans;
+    map<int, ControlClient> clients;    // fd -> client
+};
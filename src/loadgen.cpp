@@ -0,0 +1,385 @@
+//
+// Created by YANHAI on 2020/1/22.
+//
+// auto_clean_loadgen: producers writing date structured files into a watched directory
+// while auto_clean runs against it, reports whether the cleaner keeps up as JSON.
+//
+// Run it on a small filesystem so eviction starts soon, e.g.
+//     mount -t tmpfs -o size=2g tmpfs /data/cache
+//     auto_clean -c test.json &
+//     auto_clean_loadgen --path /data/cache --rate 2G --size 8M --producers 8 --limit 80 --report r.json
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include <json/json.h>
+#include <boost/filesystem.hpp>
+#include "auto_clean_ring.h"
+#include "util/cmdline.hpp"
+#include "util/config.h"
+#include "util/log.h"
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+#define LOADGEN_CHUNK   (1 << 20)
+
+struct Options {
+    string path;
+    double rate;            // bytes/s of all producers
+    off_t size;             // bytes per file
+    unsigned int producers;
+    unsigned int fanout;    // top level sub directories, like smtp, http
+    unsigned int hour;      // seconds of one simulated hour directory
+    unsigned int duration;  // seconds
+    unsigned int limit;     // limit of the clean entry, percent
+    unsigned int interval;  // ms between samples
+    string pidfile;
+    string report;
+    string ring;            // notify ring of auto_clean, "" to let it scan
+};
+
+struct Producer {
+    unsigned long files;
+    unsigned long long bytes;
+    unsigned long enospc;
+    unsigned long errors;
+    vector<uint32_t> latency;   // us per file, open to close
+};
+
+static atomic<bool> stop(false);
+static ac_ring ring = {nullptr, nullptr, 0};
+static atomic<unsigned long> ring_dropped(0);
+
+static long long usec_since(Clock::time_point begin)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+}
+
+/**
+ * 模拟的时间: 每 hour 秒为一个小时目录, 目录树增长得比实际时间快
+ */
+static string hour_dir(const Options &opt, unsigned int category, time_t start, Clock::time_point begin)
+{
+    char buf[64];
+    time_t t = start + (time_t) (usec_since(begin) / 1000000 * 3600 / opt.hour);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "/log/%Y/%m/%d/%H", &tm);
+    return opt.path + "/cat" + std::to_string(category) + buf;
+}
+
+static void produce(const Options &opt, unsigned int id, Producer &p, Clock::time_point begin)
+{
+    static vector<char> chunk(LOADGEN_CHUNK, 'x');
+    double rate = opt.rate / opt.producers;
+    time_t start = time(nullptr);
+    string dir;
+    unsigned long seq = 0;
+
+    while (!stop) {
+        // 按速率计划下一个文件的时间, 落后时不等待. 失败的文件不计入, 之后重试
+        auto due = (long long) ((double) p.bytes / rate * 1000000);
+        auto now = usec_since(begin);
+        if (due > now)
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(due - now, 100000LL)));
+        if (due > usec_since(begin))
+            continue;
+
+        auto d = hour_dir(opt, id % opt.fanout, start, begin);
+        if (d != dir) {
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(d, ec);
+            dir = d;
+        }
+
+        auto path = dir + "/p" + std::to_string(id) + "-" + std::to_string(seq++) + ".pcap";
+        auto t0 = Clock::now();
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            p.errors++;
+            if (errno == ENOENT)
+                dir.clear();    // 目录被清理了, 重新创建
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        off_t left = opt.size;
+        int err = 0;
+        while (left > 0) {
+            auto n = write(fd, chunk.data(), (size_t) std::min(left, (off_t) chunk.size()));
+            if (n < 0) {
+                err = errno;
+                break;
+            }
+            left -= n;
+        }
+        if (!err && ring.header && ac_ring_notify_fd(&ring, AC_RING_CLOSED, fd, path.c_str()) != 0)
+            ring_dropped++;
+        close(fd);
+
+        if (err) {
+            // 磁盘已满: 清理没有跟上
+            if (err == ENOSPC)
+                p.enospc++;
+            else
+                p.errors++;
+            unlink(path.c_str());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        p.files++;
+        p.bytes += opt.size;
+        p.latency.push_back((uint32_t) std::min(usec_since(t0), (long long) UINT32_MAX));
+    }
+}
+
+/**
+ * 和 df 的 Use% 相同
+ */
+static double used_percent(const string &path)
+{
+    struct statvfs st;
+    if (statvfs(path.c_str(), &st) != 0)
+        return 0;
+    double used = (double) (st.f_blocks - st.f_bfree);
+    double total = used + (double) st.f_bavail;
+    return total > 0 ? used * 100 / total : 0;
+}
+
+static pid_t read_pid(const string &pidfile)
+{
+    ifstream in(pidfile);
+    pid_t pid = 0;
+    in >> pid;
+    return pid > 0 && kill(pid, 0) == 0 ? pid : 0;
+}
+
+/**
+ * 进程的 utime + stime, 秒
+ */
+static double cpu_seconds(pid_t pid)
+{
+    ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    string line;
+    getline(in, line);
+    auto pos = line.rfind(')');     // comm 中可能有空格
+    if (pos == string::npos)
+        return 0;
+    istringstream is(line.substr(pos + 2));
+    string field;
+    unsigned long long utime = 0, stime = 0;
+    // state 是第 3 个字段, utime 和 stime 是第 14, 15 个
+    for (int i = 3; i <= 15 && is >> field; i++) {
+        if (i == 14)
+            utime = std::stoull(field);
+        else if (i == 15)
+            stime = std::stoull(field);
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static unsigned long rss_kb(pid_t pid)
+{
+    ifstream in("/proc/" + std::to_string(pid) + "/status");
+    string line;
+    while (getline(in, line)) {
+        if (!line.compare(0, 6, "VmRSS:"))
+            return std::stoul(line.substr(6));
+    }
+    return 0;
+}
+
+static Json::Value percentiles(vector<uint32_t> &v)
+{
+    Json::Value r;
+    if (v.empty())
+        return r;
+    std::sort(v.begin(), v.end());
+    auto at = [&v](double q) {
+        return (Json::UInt) v[std::min(v.size() - 1, (size_t) (q * v.size()))];
+    };
+    unsigned long long sum = 0;
+    for (auto x: v)
+        sum += x;
+    r["p50"] = at(0.50);
+    r["p90"] = at(0.90);
+    r["p99"] = at(0.99);
+    r["p999"] = at(0.999);
+    r["max"] = (Json::UInt) v.back();
+    r["mean"] = (Json::UInt64) (sum / v.size());
+    return r;
+}
+
+static void parse_command_line(int argc, char **argv, Options &opt)
+{
+    cmdline::parser args;
+    args.add<string>("path", 'p', "directory watched by auto_clean, on a small loop or tmpfs mount", true);
+    args.add<string>("rate", 'r', "bytes per second of all producers, e.g. 2G", false, "100M");
+    args.add<string>("size", 's', "bytes per file", false, "8M");
+    args.add<unsigned int>("producers", 'n', "writer threads", false, 4);
+    args.add<unsigned int>("fanout", 'f', "top level sub directories (cat0, cat1, ...)", false, 2);
+    args.add<unsigned int>("hour", 0, "seconds of one simulated hour directory", false, 60);
+    args.add<unsigned int>("duration", 'd', "seconds to run", false, 60);
+    args.add<unsigned int>("limit", 'l', "limit of the clean entry, percent", false, 80);
+    args.add<unsigned int>("interval", 0, "milliseconds between usage samples", false, 100);
+    args.add<string>("pidfile", 0, "pid file of the running auto_clean", false, DEFAULT_PIDFILE);
+    args.add<string>("report", 'o', "JSON report file, default stdout", false, "");
+    args.add<string>("ring", 0, "notify ring of auto_clean, producers announce their files", false, "");
+    args.set_program_name(argv[0]);
+    args.parse_check(argc, argv);
+
+    opt.path = args.get<string>("path");
+    Json::UInt64 rate = 0;
+    Json::UInt64 size = 0;
+    if (!Config::size_string_to_uint64(Json::Value(args.get<string>("rate")), rate) ||
+        !Config::size_string_to_uint64(Json::Value(args.get<string>("size")), size)) {
+        cerr << "rate and size must be sizes like 64M" << endl;
+        exit(EXIT_FAILURE);
+    }
+    opt.rate = (double) rate;
+    opt.size = (off_t) size;
+    opt.producers = std::max(1u, args.get<unsigned int>("producers"));
+    opt.fanout = std::max(1u, args.get<unsigned int>("fanout"));
+    opt.hour = std::max(1u, args.get<unsigned int>("hour"));
+    opt.duration = args.get<unsigned int>("duration");
+    opt.limit = args.get<unsigned int>("limit");
+    opt.interval = std::max(1u, args.get<unsigned int>("interval"));
+    opt.pidfile = args.get<string>("pidfile");
+    opt.report = args.get<string>("report");
+    opt.ring = args.get<string>("ring");
+
+    if (opt.rate <= 0 || opt.size <= 0) {
+        cerr << "rate and size must be positive" << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    parse_command_line(argc, argv, opt);
+    init_logger("info");
+
+    pid_t pid = read_pid(opt.pidfile);
+    if (!pid)
+        spdlog::warn("auto_clean is not running ({}), cleaner cpu and rss are not reported", opt.pidfile);
+
+    if (!opt.ring.empty() && ac_ring_open(&ring, opt.ring.c_str()) != 0) {
+        spdlog::error("open notify ring {} failed: {}", opt.ring, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    vector<Producer> producers(opt.producers, Producer{0, 0, 0, 0, vector<uint32_t>()});
+    vector<std::thread> threads;
+    auto begin = Clock::now();
+    double cpu_begin = pid ? cpu_seconds(pid) : 0;
+    for (unsigned int i = 0; i < opt.producers; i++)
+        threads.emplace_back(produce, std::cref(opt), i, std::ref(producers[i]), begin);
+
+    // 采样: 使用率, 超过 limit 的时间和每次超过后回到 limit 以下的时间 (eviction lag)
+    double peak = 0, used = 0, above = 0, lag_max = 0, lag_sum = 0;
+    unsigned long samples = 0, episodes = 0, rss_peak = 0;
+    long long episode_begin = -1, last = 0;
+    while (usec_since(begin) < (long long) opt.duration * 1000000) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(opt.interval));
+        auto now = usec_since(begin);
+        used = used_percent(opt.path);
+        peak = std::max(peak, used);
+        samples++;
+        if (used > opt.limit) {
+            above += (double) (now - last) / 1000000;
+            if (episode_begin < 0)
+                episode_begin = now;
+        } else if (episode_begin >= 0) {
+            double lag = (double) (now - episode_begin) / 1000000;
+            lag_max = std::max(lag_max, lag);
+            lag_sum += lag;
+            episodes++;
+            episode_begin = -1;
+        }
+        if (pid)
+            rss_peak = std::max(rss_peak, rss_kb(pid));
+        last = now;
+    }
+    stop = true;
+    for (auto &t: threads)
+        t.join();
+    double elapsed = (double) usec_since(begin) / 1000000;
+
+    // 运行结束时仍然超过 limit, 也计入
+    if (episode_begin >= 0) {
+        double lag = (double) (last - episode_begin) / 1000000;
+        lag_max = std::max(lag_max, lag);
+        lag_sum += lag;
+        episodes++;
+    }
+
+    Json::Value report;
+    report["config"]["path"] = opt.path;
+    report["config"]["rate"] = opt.rate;
+    report["config"]["size"] = (Json::Int64) opt.size;
+    report["config"]["producers"] = opt.producers;
+    report["config"]["fanout"] = opt.fanout;
+    report["config"]["duration"] = opt.duration;
+    report["config"]["limit"] = opt.limit;
+
+    vector<uint32_t> latency;
+    unsigned long files = 0, enospc = 0, errors = 0;
+    unsigned long long bytes = 0;
+    for (auto &p: producers) {
+        files += p.files;
+        bytes += p.bytes;
+        enospc += p.enospc;
+        errors += p.errors;
+        latency.insert(latency.end(), p.latency.begin(), p.latency.end());
+    }
+    report["written"]["files"] = (Json::UInt64) files;
+    report["written"]["bytes"] = (Json::UInt64) bytes;
+    report["written"]["rate"] = (double) bytes / elapsed;
+    report["written"]["enospc"] = (Json::UInt64) enospc;
+    report["written"]["errors"] = (Json::UInt64) errors;
+    if (ring.header)
+        report["written"]["ring_dropped"] = (Json::UInt64) ring_dropped;
+    report["latency_us"] = percentiles(latency);
+
+    report["usage"]["peak_percent"] = peak;
+    report["usage"]["final_percent"] = used;
+    report["usage"]["above_limit_seconds"] = above;
+    report["usage"]["samples"] = (Json::UInt64) samples;
+    report["eviction_lag"]["episodes"] = (Json::UInt64) episodes;
+    report["eviction_lag"]["max_seconds"] = lag_max;
+    report["eviction_lag"]["mean_seconds"] = episodes ? lag_sum / episodes : 0;
+
+    if (pid) {
+        double cpu = cpu_seconds(pid) - cpu_begin;
+        report["cleaner"]["pid"] = pid;
+        report["cleaner"]["cpu_seconds"] = cpu;
+        report["cleaner"]["cpu_percent"] = cpu * 100 / elapsed;
+        report["cleaner"]["rss_peak_kb"] = (Json::UInt64) rss_peak;
+        report["cleaner"]["rss_final_kb"] = (Json::UInt64) rss_kb(pid);
+    }
+
+    Json::StreamWriterBuilder builder;
+    auto out = Json::writeString(builder, report);
+    if (opt.report.empty()) {
+        cout << out << endl;
+    } else {
+        ofstream f(opt.report, ios::trunc);
+        f << out << endl;
+        if (!f) {
+            spdlog::error("write report {} failed", opt.report);
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
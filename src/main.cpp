@@ -10,22 +10,67 @@
 #include "util-disk.h"
 #include "util-file.h"
 #include "tm-threads.h"
+#include "util-reactor.h"
+#include "util-trace.h"
 #include "worker.h"
 #include "manager.h"
+#include "control.h"
 
 using namespace std;
 
-volatile sig_atomic_t sigint_count = 0;
-volatile sig_atomic_t sigterm_count = 0;
-
-static void SignalHandlerSigint(__attribute__((unused)) int sig)
+/**
+ * \brief reload config on SIGHUP, running workers keep their queues
+ */
+static void reload_config()
 {
-    sigint_count = 1;
+    spdlog::info("SIGHUP received, reloading config");
+    if (!Config::instance().reload_config()) {
+        spdlog::error("reload config failed, keep the running config");
+        return;
+    }
+
+    Worker::reload(Config::instance()["clean"]);
+    spdlog::info("config reloaded, {} clean processing threads", Worker::worker_threads());
 }
 
-static void SignalHandlerSigterm(__attribute__((unused)) int sig)
+/**
+ * \brief signals are read from a signalfd by the reactor, handled on the main thread
+ *
+ * SIGUSR1 writes the trace file (--trace-file) and wakes up all threads for a pass at once,
+ * SIGUSR2 toggles debug logging.
+ */
+static void handle_signal(int signo)
 {
-    sigterm_count = 1;
+    static spdlog::level::level_enum level = spdlog::level::off;
+
+    switch (signo) {
+        case SIGINT:
+        case SIGTERM:
+            spdlog::info("Signal Received. Stopping engine");
+            Reactor::instance().stop();
+            break;
+        case SIGHUP:
+            reload_config();
+            break;
+        case SIGUSR1:
+            spdlog::info("SIGUSR1 received, waking up all threads");
+            Trace::dump();
+            TmThreads::foreach([](ThreadVars *tv) { tv->wakeup(); });
+            break;
+        case SIGUSR2:
+            if (level == spdlog::level::off) {
+                level = spdlog::default_logger()->level();
+                spdlog::set_level(spdlog::level::debug);
+            } else {
+                spdlog::set_level(level);
+                level = spdlog::level::off;
+            }
+            spdlog::info("SIGUSR2 received, log level {}",
+                         spdlog::level::to_string_view(spdlog::default_logger()->level()).data());
+            break;
+        default:
+            break;
+    }
 }
 
 void _print_version()
@@ -33,6 +78,114 @@ void _print_version()
     spdlog::info("This is {} version {}", PROG_NAME, PROG_VER);
 }
 
+/**
+ * \brief du of the running daemon's index, printed like du(1)
+ */
+static string format_time(time_t t)
+{
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    return buf;
+}
+
+static void print_du(const Json::Value &node)
+{
+    cout << node["bytes"].asInt64() << "\t" << node["files"].asUInt64() << "\t"
+         << format_time(node["oldest"].asInt64()) << "\t" << format_time(node["newest"].asInt64()) << "\t"
+         << node["path"].asString() << endl;
+    for (auto &child: node["children"])
+        print_du(child);
+}
+
+static int du(const string &path, unsigned int depth)
+{
+    Json::Value response;
+    if (!Control::request("du " + path + " " + std::to_string(depth), response))
+        return EXIT_FAILURE;
+
+    if (response["status"].asString() != "ok") {
+        cerr << response["message"].asString() << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "bytes\tfiles\toldest\tnewest\tpath" << endl;
+    print_du(response["result"]);
+    return 0;
+}
+
+static int reserve(const string &path, const string &bytes, unsigned int timeout)
+{
+    Json::Value response;
+    auto line = "reserve " + bytes + " " + path + " " + std::to_string(timeout);
+    if (!Control::request(line, response))
+        return EXIT_FAILURE;
+
+    if (response["status"].asString() != "ok") {
+        cerr << response["message"].asString() << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << response["free"].asInt64() << " bytes free" << endl;
+    return 0;
+}
+
+/**
+ * \brief files older than age and the oldest files freeing bytes, from the running daemon's queue
+ */
+static int plan(const string &path, const string &bytes, const string &age)
+{
+    Json::Value response;
+    Json::Value age_value(age);
+    auto line = "plan " + path + " " + bytes + " " + std::to_string(Config::time_string_to_uint64(age_value));
+    if (!Control::request(line, response))
+        return EXIT_FAILURE;
+
+    if (response["status"].asString() != "ok") {
+        cerr << response["message"].asString() << endl;
+        return EXIT_FAILURE;
+    }
+
+    auto &result = response["result"];
+    cout << "older than " << age << ": " << result["older"]["files"].asUInt64() << " files "
+         << result["older"]["bytes"].asInt64() << " bytes" << endl;
+    cout << "free " << bytes << ": " << result["cut"]["files"].asUInt64() << " files "
+         << result["cut"]["bytes"].asInt64() << " bytes, up to " << format_time(result["cut"]["newest"].asInt64())
+         << endl;
+    cout << result["files"].asUInt64() << " files in " << result["path"].asString() << ", "
+         << result["kernel"].asString() << " " << result["usec"].asUInt64() << " us" << endl;
+    if (!result["exact"].asBool()) {
+        cout << "approximate, the daemon evicts by:";
+        for (auto &option: result["approximate"])
+            cout << " " << option.asString();
+        cout << endl;
+    }
+    return 0;
+}
+
+/**
+ * \brief ballast state of every mount of the running daemon
+ */
+static int ballast()
+{
+    Json::Value response;
+    if (!Control::request("ballast", response))
+        return EXIT_FAILURE;
+
+    if (response["status"].asString() != "ok") {
+        cerr << response["message"].asString() << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "state\tsize\tallocated\treleases\tlast release\tpath" << endl;
+    for (auto &b: response["result"]) {
+        auto released_at = b["released_at"].asInt64();
+        cout << b["state"].asString() << "\t" << b["size"].asInt64() << "\t" << b["allocated"].asInt64() << "\t"
+             << b["releases"].asUInt64() << "\t" << (released_at ? format_time(released_at) : "-") << "\t"
+             << b["path"].asString() << endl;
+    }
+    return 0;
+}
+
 static void parse_command_line(int argc, char **argv, string &config_file)
 {
     cmdline::parser args;
@@ -42,6 +195,16 @@ static void parse_command_line(int argc, char **argv, string &config_file)
                      cmdline::oneof<string>("debug", "info", "warning", "error",
                                             "critical", "off"));
     args.add("nolog", 0, "not log to file");
+    args.add<string>("du", 0, "print directory sizes of a path from the running daemon", false);
+    args.add<unsigned int>("depth", 0, "sub directory levels of --du", false, 0);
+    args.add<string>("reserve", 0, "ask the running daemon to free space on the mount of a path", false);
+    args.add<string>("bytes", 0, "bytes of --reserve or --plan, e.g. 4G", false, "0");
+    args.add<string>("plan", 0, "ask the running daemon what is older than --age and what frees --bytes", false);
+    args.add<string>("age", 0, "age of --plan, e.g. 3d", false, "0");
+    args.add<unsigned int>("timeout", 0, "milliseconds to wait for --reserve", false, 10000);
+    args.add("ballast", 0, "print the ballast of each mount of the running daemon");
+    args.add<string>("trace-file", 0, "record phase spans, written as Chrome trace JSON on exit and SIGUSR1", false);
+    args.add<unsigned int>("trace-events", 0, "spans kept in memory for --trace-file", false, 65536);
     args.add("version", 'V', "output version information and exit");
     args.set_program_name(argv[0]);
 
@@ -52,7 +215,8 @@ static void parse_command_line(int argc, char **argv, string &config_file)
         exit(0);
     }
 
-    if (args.exist("nolog"))
+    if (args.exist("nolog") || args.exist("du") || args.exist("reserve") || args.exist("plan") ||
+        args.exist("ballast"))
         init_logger(args.get<string>("level"));
     else
         init_logger(args.get<string>("level"), "/var/log/auto_clean.log");
@@ -60,15 +224,27 @@ static void parse_command_line(int argc, char **argv, string &config_file)
     // load config
     if (!Config::instance().load_config(args.get<string>("config")))
         exit(EXIT_FAILURE);
+
+    if (args.exist("du"))
+        exit(du(args.get<string>("du"), args.get<unsigned int>("depth")));
+
+    if (args.exist("plan"))
+        exit(plan(args.get<string>("plan"), args.get<string>("bytes"), args.get<string>("age")));
+
+    if (args.exist("ballast"))
+        exit(ballast());
+
+    if (args.exist("reserve"))
+        exit(reserve(args.get<string>("reserve"), args.get<string>("bytes"), args.get<unsigned int>("timeout")));
+
+    if (args.exist("trace-file"))
+        Trace::enable(args.get<string>("trace-file"), args.get<unsigned int>("trace-events"));
 }
 
 int main(int argc, char **argv)
 {
     string config_file = DEFAULT_CONFIG;
 
-    signal(SIGINT, SignalHandlerSigint);
-    signal(SIGTERM, SignalHandlerSigterm);
-
     SetThreadName("main");
     parse_command_line(argc, argv, config_file);
     _print_version();
@@ -76,6 +252,15 @@ int main(int argc, char **argv)
     if (Pidfile::instance().testCreate() != 0)
         return 1;
 
+    // 在创建线程之前阻塞信号, 所有线程继承, 信号只从 signalfd 读取
+    if (!Reactor::instance().signals({SIGINT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2}, handle_signal)) {
+        Pidfile::instance().remove();
+        return 1;
+    }
+
+    // ballast 的使用率检查在主线程的定时器中, 不受 worker sleep 的影响
+    Ballast::watch();
+
     // start worker threads
     for (auto &WorkConfig: Config::instance()["clean"]) {
         if (!WorkConfig["enabled"].asBool()) {
@@ -96,21 +281,22 @@ int main(int argc, char **argv)
         delete tv;
     }
 
+    // start control thread
+    tv = Control::create();
+    if (TmThreads::spawn(tv) != 0) {
+        spdlog::error("TmThreadSpawn failed");
+        delete tv;
+    }
+
     spdlog::info("all {} clean processing threads, 0 management threads initialized, engine started.",
                  Worker::worker_threads());
-    while (true) {
-        if (sigint_count > 0 ||
-            sigterm_count > 0) {
-            spdlog::info("Signal Received. Stopping engine");
-            break;
-        }
-
-        usleep(100 * 1000);
-    }
+    Reactor::instance().run();
+    spdlog::debug("reactor: {} wakeups", Reactor::instance().wakeups);
 
     // stop all threads
     TmThreads::kills();
     TmThreads::clears();
+    Trace::dump();
 
     // clear pid file and config
     Pidfile::instance().remove();
@@ -0,0 +1,162 @@
+//
+// Created by YANHAI on 2020/1/17.
+//
+
+#include <cctype>
+#include <set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <boost/timer/timer.hpp>
+#include "openfiles.h"
+#include "tm-threads.h"
+#include "util/config.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define OPEN_FILES_DEFAULT_INTERVAL 5   // seconds
+
+Mutex OpenFiles::instance_lock = MUTEX_INITIALIZER;
+OpenFiles *OpenFiles::open_files = nullptr;
+
+OpenFiles::OpenFiles()
+{
+    name = "OpenFiles";
+    auto &config = Config::instance()["open-files"];
+    sleep = config.get("interval", OPEN_FILES_DEFAULT_INTERVAL).asUInt();
+    if (sleep == 0)
+        sleep = OPEN_FILES_DEFAULT_INTERVAL;
+
+    MutexInit(&snapshot_mutex, nullptr);
+    snapshot = make_shared<const Snapshot>();
+    scans = 0;
+    scan_usec = 0;
+}
+
+OpenFiles::~OpenFiles()
+{
+    MutexLock(&instance_lock);
+    if (open_files == this)
+        open_files = nullptr;
+    MutexUnlock(&instance_lock);
+
+    MutexDestroy(&snapshot_mutex);
+}
+
+OpenFiles *OpenFiles::instance()
+{
+    MutexLock(&instance_lock);
+    if (!open_files) {
+        auto tv = new OpenFiles();
+        if (TmThreads::spawn(tv) != 0) {
+            spdlog::error("TmThreadSpawn failed");
+            delete tv;
+        } else {
+            open_files = tv;
+        }
+    }
+    auto r = open_files;
+    MutexUnlock(&instance_lock);
+    return r;
+}
+
+int OpenFiles::init()
+{
+    // 第一次扫描在 init 中完成, worker 拿到实例时已经可以查询
+    auto s = make_shared<Snapshot>();
+    scan(*s);
+    MutexLock(&snapshot_mutex);
+    snapshot = s;
+    MutexUnlock(&snapshot_mutex);
+    spdlog::info("{}: {} open files, scan every {}s", name, s->inodes.size(), sleep);
+    return 0;
+}
+
+shared_ptr<const OpenFiles::Snapshot> OpenFiles::current()
+{
+    MutexLock(&snapshot_mutex);
+    auto s = snapshot;
+    MutexUnlock(&snapshot_mutex);
+    return s;
+}
+
+bool OpenFiles::isOpen(dev_t dev, ino_t ino)
+{
+    auto s = current();
+    return s->inodes.count(make_pair(dev, ino)) > 0;
+}
+
+off_t OpenFiles::deletedBytes(dev_t dev)
+{
+    auto s = current();
+    auto it = s->deleted_bytes.find(dev);
+    return it == s->deleted_bytes.end() ? 0 : it->second;
+}
+
+/**
+ * 读取所有进程的 /proc/<pid>/fd, stat 得到打开的普通文件的 dev+inode,
+ * st_nlink 为 0 的是已经删除但还没有关闭的文件
+ */
+void OpenFiles::scan(Snapshot &s)
+{
+    boost::timer::cpu_timer cpu_timer;
+    struct dirent *ent;
+    struct stat st;
+    set<pair<dev_t, ino_t>> deleted;
+
+    DIR *proc = opendir("/proc");
+    if (!proc) {
+        spdlog::warn("{}: open /proc failed: {}", name, strerror(errno));
+        return;
+    }
+
+    while ((ent = readdir(proc)) != nullptr && !checkFlag(THV_KILL)) {
+        if (!isdigit((unsigned char) ent->d_name[0]))
+            continue;
+
+        string fd_dir = string("/proc/") + ent->d_name + "/fd";
+        DIR *d = opendir(fd_dir.c_str());
+        if (!d)
+            continue;   // 进程已经退出或者没有权限
+
+        struct dirent *fd_ent;
+        while ((fd_ent = readdir(d)) != nullptr) {
+            if (fd_ent->d_name[0] == '.')
+                continue;
+            // 跟随链接, 得到打开的文件本身
+            if (fstatat(dirfd(d), fd_ent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            s.inodes.insert(make_pair(st.st_dev, st.st_ino));
+            if (st.st_nlink == 0 && deleted.insert(make_pair(st.st_dev, st.st_ino)).second)
+                s.deleted_bytes[st.st_dev] += (off_t) st.st_blocks * 512;
+        }
+        closedir(d);
+    }
+    closedir(proc);
+
+    cpu_timer.stop();
+    scans++;
+    scan_usec += cpu_timer.elapsed().wall / 1000;
+}
+
+int OpenFiles::loop()
+{
+    auto s = make_shared<Snapshot>();
+    scan(*s);
+    MutexLock(&snapshot_mutex);
+    snapshot = s;
+    MutexUnlock(&snapshot_mutex);
+    return 0;
+}
+
+void OpenFiles::exitPrintStats()
+{
+    spdlog::info("{}: {} scans, {} us per scan", name, scans, scans ? scan_usec / scans : 0);
+}
+
+int OpenFiles::deinit()
+{
+    spdlog::debug("OpenFiles thread deinit: {}", name);
+    return 0;
+}
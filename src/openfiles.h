@@ -0,0 +1,76 @@
+//
+// Created by YANHAI on 2020/1/17.
+//
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <unordered_set>
+#include <sys/types.h>
+#include "util-threads.h"
+
+/**
+ * \brief Files held open by any process, from a periodic scan of /proc/<pid>/fd
+ *
+ * Unlinking an open file frees nothing until it is closed, and the file may still be written.
+ * Workers with skip-open: true hold such files back from eviction. The result of a scan is an
+ * immutable snapshot swapped in at once, lookups never wait for a scan.
+ */
+class OpenFiles : public ThreadVars {
+protected:
+    OpenFiles();
+
+public:
+    ~OpenFiles();
+
+    virtual int init();
+
+    virtual int loop();
+
+    virtual void exitPrintStats();
+
+    virtual int deinit();
+
+    /**
+     * \brief Get the scanner, spawn it on first use
+     *
+     * \retval nullptr on failure
+     */
+    static OpenFiles *instance();
+
+    bool isOpen(dev_t dev, ino_t ino);
+
+    /**
+     * \brief Space of files already unlinked but still open on a device, freed when they are closed
+     */
+    off_t deletedBytes(dev_t dev);
+
+private:
+    struct InodeHash {
+        size_t operator()(const pair<dev_t, ino_t> &key) const
+        {
+            return std::hash<uint64_t>()((uint64_t) key.second * 31 + key.first);
+        }
+    };
+
+    struct Snapshot {
+        unordered_set<pair<dev_t, ino_t>, InodeHash> inodes;
+        map<dev_t, off_t> deleted_bytes;
+    };
+
+    shared_ptr<const Snapshot> current();
+
+    void scan(Snapshot &snapshot);
+
+private:
+    Mutex snapshot_mutex;
+    shared_ptr<const Snapshot> snapshot;
+
+    // stats
+    unsigned long scans;
+    unsigned long long scan_usec;
+
+    static Mutex instance_lock;
+    static OpenFiles *open_files;
+};
@@ -0,0 +1,328 @@
+//
+// Created by YANHAI on 2020/1/6.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "reaper.h"
+#include "tm-threads.h"
+#include "util-trace.h"
+#include "util/config.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define REAPER_DEFAULT_CHUNK    (256LL << 20)   // 256MB
+#define REAPER_DEFAULT_LARGE    (1LL << 30)     // 1GB
+
+Mutex Reaper::reapers_lock = MUTEX_INITIALIZER;
+map<string, Reaper *> Reaper::reapers;
+
+Reaper::Reaper(const string &mount_point) : mount_point(mount_point)
+{
+    name = "Reaper#" + std::to_string(reapers.size() + 1);
+    sleep = 1;
+    trash = mount_point;
+    if (trash.empty() || trash[trash.length() - 1] != '/')
+        trash += "/";
+    trash += REAPER_TRASH_DIR;
+
+    auto &config = Config::instance()["reaper"];
+    Json::UInt64 value = 0;
+    if (!Config::size_string_to_uint64(config["chunk"], value))
+        spdlog::warn("{}: invalid reaper chunk, use the default", name);
+    chunk = (off_t) value;
+    value = 0;
+    if (!Config::size_string_to_uint64(config["large"], value))
+        spdlog::warn("{}: invalid reaper large, use the default", name);
+    large = (off_t) value;
+    punch_hole = config["punch-hole"].asBool();
+    if (chunk <= 0)
+        chunk = REAPER_DEFAULT_CHUNK;
+    if (large <= 0)
+        large = REAPER_DEFAULT_LARGE;
+
+    // 后台线程, 默认不和生产者抢 I/O 和 CPU, 磁盘将满时提升
+    const string &affinity = Config::list_to_string(config["cpu-affinity"]);
+    if (!sched_policy.parse(config.get("ioprio", "idle").asString(), config.get("sched", "nice:19").asString(),
+                            affinity))
+        sched_policy.parse("idle", "nice:19", affinity);
+    if (!critical_policy.parse(config.get("critical-ioprio", "be:0").asString(),
+                               config.get("critical-sched", "normal").asString(), affinity))
+        critical_policy.parse("be:0", "normal", affinity);
+    urgent = 0;
+    escalated = false;
+
+    MutexInit(&queue_mutex, nullptr);
+    pending_bytes = 0;
+    seq = 0;
+    r_file = 0;
+    r_dir = 0;
+    r_bytes = 0;
+}
+
+Reaper::~Reaper()
+{
+    MutexLock(&reapers_lock);
+    auto it = reapers.find(mount_point);
+    if (it != reapers.end() && it->second == this)
+        reapers.erase(it);
+    MutexUnlock(&reapers_lock);
+
+    MutexDestroy(&queue_mutex);
+}
+
+Reaper *Reaper::instance(const string &mount_point)
+{
+    Reaper *reaper = nullptr;
+
+    MutexLock(&reapers_lock);
+    auto it = reapers.find(mount_point);
+    if (it != reapers.end()) {
+        reaper = it->second;
+    } else {
+        reaper = new Reaper(mount_point);
+        if (TmThreads::spawn(reaper) != 0) {
+            spdlog::error("TmThreadSpawn failed");
+            delete reaper;
+            reaper = nullptr;
+        } else {
+            reapers[mount_point] = reaper;
+        }
+    }
+    MutexUnlock(&reapers_lock);
+
+    return reaper;
+}
+
+int Reaper::init()
+{
+    if (mkdir(trash.c_str(), 0700) != 0 && errno != EEXIST) {
+        spdlog::error("{}: create trash dir {} failed: {}", name, trash, strerror(errno));
+        return 0;
+    }
+
+    load_trash();
+    spdlog::info("{}: reap {} with chunk {} large {}{}", name, trash, chunk, large,
+                 punch_hole ? " (punch hole)" : "");
+    return 0;
+}
+
+/**
+ * 删除后释放的空间: 已分配的块, 还有其他硬链接时为 0
+ */
+static off_t freed_bytes(const struct stat &st)
+{
+    if (S_ISDIR(st.st_mode) || st.st_nlink > 1)
+        return 0;
+    return (off_t) st.st_blocks * 512;
+}
+
+/**
+ * 上次退出时没有删除完的文件
+ */
+void Reaper::load_trash()
+{
+    boost::system::error_code ec;
+    boost::filesystem::directory_iterator end_iter;
+    for (boost::filesystem::directory_iterator iter(trash, ec); !ec && iter != end_iter; iter.increment(ec)) {
+        struct stat st;
+        auto &path = iter->path().string();
+        if (lstat(path.c_str(), &st) != 0)
+            continue;
+        enqueue(path, freed_bytes(st), S_ISDIR(st.st_mode));
+    }
+}
+
+void Reaper::enqueue(const string &path, off_t bytes, bool dir)
+{
+    MutexLock(&queue_mutex);
+    queue.push_back(Victim{path, bytes, dir});
+    pending_bytes += bytes;
+    MutexUnlock(&queue_mutex);
+}
+
+bool Reaper::stage(const string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+        return false;
+
+    MutexLock(&queue_mutex);
+    auto target = trash + "/" + std::to_string(time(nullptr)) + "." + std::to_string(++seq) + "." +
+                  boost::filesystem::path(path).filename().string();
+    MutexUnlock(&queue_mutex);
+
+    if (rename(path.c_str(), target.c_str()) != 0) {
+        spdlog::debug("{}: stage {} failed: {}", name, path, strerror(errno));
+        return false;
+    }
+
+    enqueue(target, freed_bytes(st), S_ISDIR(st.st_mode));
+    wakeup();
+    return true;
+}
+
+void Reaper::escalate(Reaper *reaper, bool on)
+{
+    MutexLock(&reapers_lock);
+    for (auto &it: reapers) {
+        if (it.second == reaper) {
+            reaper->urgent += on ? 1 : -1;
+            reaper->wakeup();
+            break;
+        }
+    }
+    MutexUnlock(&reapers_lock);
+}
+
+void Reaper::notify(ThreadVars *tv)
+{
+    MutexLock(&queue_mutex);
+    if (std::find(waiters.begin(), waiters.end(), tv) == waiters.end())
+        waiters.push_back(tv);
+    MutexUnlock(&queue_mutex);
+}
+
+void Reaper::forget(ThreadVars *tv)
+{
+    MutexLock(&reapers_lock);
+    for (auto &it: reapers) {
+        MutexLock(&it.second->queue_mutex);
+        it.second->waiters.remove(tv);
+        MutexUnlock(&it.second->queue_mutex);
+    }
+    MutexUnlock(&reapers_lock);
+}
+
+void Reaper::progress()
+{
+    MutexLock(&queue_mutex);
+    for (auto tv: waiters)
+        tv->wakeup();
+    waiters.clear();
+    MutexUnlock(&queue_mutex);
+}
+
+void Reaper::update_priority()
+{
+    bool on = urgent > 0;
+    if (on == escalated)
+        return;
+
+    escalated = on;
+    (escalated ? critical_policy : sched_policy).apply(name);
+    spdlog::info("{}: {} priority: {}", name, escalated ? "escalate" : "restore",
+                 (escalated ? critical_policy : sched_policy).str());
+}
+
+void Reaper::reap_file(const Victim &victim)
+{
+    off_t left = victim.bytes;      // 还没有计入进度的空间
+
+    if (victim.bytes > large) {
+        struct stat st;
+        off_t size = 0;
+        int fd = open(victim.path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+        // 还有其他硬链接时截断会破坏另一个文件, 直接 unlink
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+            // 偏移用文件长度, 进度按每一步实际减少的块计算(稀疏文件的长度和占用不同)
+            size = st.st_size;
+            blkcnt_t blocks = st.st_blocks;
+            while (size > 0 && !checkFlag(THV_KILL)) {
+                update_priority();
+                off_t new_size = size > chunk ? size - chunk : 0;
+                int r;
+                if (punch_hole)
+                    r = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, new_size, size - new_size);
+                else
+                    r = ftruncate(fd, new_size);
+                if (r != 0) {
+                    if (punch_hole && errno == EOPNOTSUPP) {
+                        punch_hole = false;
+                        continue;
+                    }
+                    spdlog::warn("{}: truncate {} failed: {}", name, victim.path, strerror(errno));
+                    break;
+                }
+                size = new_size;
+                if (fstat(fd, &st) != 0)
+                    break;
+                off_t freed = std::min(left, (off_t) (blocks - st.st_blocks) * 512);
+                if (freed > 0) {
+                    pending_bytes -= freed;
+                    r_bytes += freed;
+                    left -= freed;
+                    progress();
+                }
+                blocks = st.st_blocks;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+
+        if (size > 0 && checkFlag(THV_KILL)) {
+            // 留在回收站中, 下次启动时继续
+            pending_bytes -= left;
+            return;
+        }
+    }
+
+    if (unlink(victim.path.c_str()) != 0)
+        spdlog::warn("{}: unlink {} failed: {}", name, victim.path, strerror(errno));
+    else
+        r_file += 1;
+    pending_bytes -= left;
+    r_bytes += left;
+}
+
+void Reaper::reap(const Victim &victim)
+{
+    TraceSpan span("reap", &victim.path);
+    if (!victim.dir) {
+        reap_file(victim);
+        return;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(victim.path, ec);
+    if (ec)
+        spdlog::warn("{}: remove {} failed: {}", name, victim.path, ec.message());
+    else
+        r_dir += 1;
+}
+
+int Reaper::loop()
+{
+    while (!checkFlag(THV_KILL)) {
+        update_priority();
+        MutexLock(&queue_mutex);
+        if (queue.empty()) {
+            MutexUnlock(&queue_mutex);
+            break;
+        }
+        auto victim = queue.front();
+        queue.pop_front();
+        MutexUnlock(&queue_mutex);
+
+        reap(victim);
+        progress();
+    }
+    return 0;
+}
+
+void Reaper::exitPrintStats()
+{
+    spdlog::info("{}: reaped {} files {} dirs, {} bytes, {} bytes pending",
+                 name, r_file, r_dir, r_bytes, (off_t) pending_bytes);
+}
+
+int Reaper::deinit()
+{
+    spdlog::debug("Reaper thread deinit: {}", name);
+    return 0;
+}
@@ -0,0 +1,126 @@
+//
+// Created by YANHAI on 2020/1/6.
+//
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include "util-threads.h"
+
+/* per-mount trash directory, created at the mount point */
+#define REAPER_TRASH_DIR ".auto_clean_trash"
+
+/**
+ * \brief Background deletion of staged files
+ *
+ * Worker threads rename their victims into the trash directory of the mount (atomic, the file
+ * disappears from the producer's namespace at once). The reaper frees them later at low
+ * priority, very large files are truncated (or hole punched) chunk by chunk before the final
+ * unlink so that a single unlink never stalls on freeing extents.
+ */
+class Reaper : public ThreadVars {
+protected:
+    Reaper(const string &mount_point);
+
+public:
+    ~Reaper();
+
+    virtual int init();
+
+    virtual int loop();
+
+    virtual void exitPrintStats();
+
+    virtual int deinit();
+
+    /**
+     * \brief Get the reaper of a mount point, spawn it if it does not exist yet
+     *
+     * \retval nullptr on failure
+     */
+    static Reaper *instance(const string &mount_point);
+
+    /**
+     * \brief Move a file or directory into the trash, it will be freed later
+     *
+     * \retval false if it can not be staged, the caller should remove it directly
+     */
+    bool stage(const string &path);
+
+    /**
+     * \brief Run at critical priority while any worker of the mount asks for it
+     *
+     * @param on true to ask, false to drop a previous request
+     * \note the reaper may already be freed at exit, nothing is done then
+     */
+    static void escalate(Reaper *reaper, bool on);
+
+    /**
+     * \brief Wake a thread up once when some staged space is freed
+     */
+    void notify(ThreadVars *tv);
+
+    /**
+     * \brief Drop the notify requests of a thread that is freed, on every reaper
+     */
+    static void forget(ThreadVars *tv);
+
+    /**
+     * \brief Bytes staged but not freed yet, they still count as used on the disk
+     */
+    off_t pendingBytes() const
+    {
+        return pending_bytes;
+    }
+
+private:
+    void progress();
+
+    struct Victim {
+        string path;
+        off_t bytes;        // 删除后释放的空间(已分配的块), 文件长度在截断时再取
+        bool dir;
+    };
+
+    void enqueue(const string &path, off_t bytes, bool dir);
+
+    void load_trash();
+
+    void reap(const Victim &victim);
+
+    void reap_file(const Victim &victim);
+
+    void update_priority();
+
+private:
+    string mount_point;
+    string trash;
+
+    // config
+    off_t chunk;        // truncate step
+    off_t large;        // files bigger than it are truncated progressively
+    bool punch_hole;
+    SchedPolicy critical_policy;
+
+    // workers of the mount above their critical threshold
+    atomic<int> urgent;
+    bool escalated;
+
+    // queue
+    Mutex queue_mutex;
+    list<Victim> queue;
+    atomic<off_t> pending_bytes;
+    unsigned long seq;
+    list<ThreadVars *> waiters;     // woken up by progress()
+
+    // stats
+    unsigned long r_file;
+    unsigned long r_dir;
+    off_t r_bytes;
+
+    static Mutex reapers_lock;
+    static map<string, Reaper *> reapers;
+};
@@ -8,6 +8,8 @@
 
 using namespace std;
 
+Mutex TmThreads::tv_root_lock = MUTEX_INITIALIZER;
+
 void *TmThreads::loop(void *td)
 {
     /* block usr2.  usr2 to be handled by the main thread only */
@@ -24,6 +26,10 @@ void *TmThreads::loop(void *td)
         cout << "Unable to set thread name" << endl;
     }
 
+    /* I/O and cpu scheduling of the thread */
+    if (!tv->sched_policy.empty())
+        tv->sched_policy.apply(tv->name);
+
     while (run) {
         if (tv->checkFlag(THV_PAUSE)) {
             tv->setFlag(THV_PAUSED);
@@ -35,9 +41,10 @@ void *TmThreads::loop(void *td)
 
         if (r != 0 || tv->checkFlag(THV_KILL)) {
             run = 0;
+            break;  // nothing wakes the thread any more once it is killed
         }
 
-        tv->ctrlCondTimedwait(tv->sleep);
+        tv->timedWait(tv->sleep);
     }
 
     tv->setFlag(THV_RUNNING_DONE);
@@ -61,22 +68,8 @@ void TmThreads::kill(ThreadVars *tv)
     tv->setFlag(THV_KILL);
     tv->setFlag(THV_DEINIT);
 
-    /* to be sure, signal more */
-    int cnt = 0;
-    while (true) {
-        if (tv->checkFlag(THV_CLOSED)) {
-            spdlog::debug("signalled the thread {} times", cnt);
-            break;
-        }
-
-        cnt++;
-
-        if (tv->ctrl_cond != nullptr) {
-            pthread_cond_broadcast(tv->ctrl_cond);
-        }
-
-        usleep(100);
-    }
+    /* the eventfd stays readable until the thread waits again, one wakeup is enough */
+    tv->wakeup();
 
     /* join it */
     pthread_join(tv->t, nullptr);
@@ -84,12 +77,17 @@ void TmThreads::kill(ThreadVars *tv)
 
 void TmThreads::kills()
 {
-    ThreadVars *tv = nullptr;
-    tv = ThreadVars::tv_root;
-
-    while (tv) {
-        kill(tv);
-        tv = tv->next;
+    bool killed = true;
+
+    /* a thread being stopped may still spawn another one, loop until all are killed */
+    while (killed) {
+        killed = false;
+        for (auto tv: snapshot()) {
+            if (tv->checkFlag(THV_DEINIT))
+                continue;
+            kill(tv);
+            killed = true;
+        }
     }
 }
 
@@ -104,14 +102,16 @@ void TmThreads::clears()
     ThreadVars *tv = nullptr;
     ThreadVars *ptv = nullptr;
 
+    MutexLock(&tv_root_lock);
     tv = ThreadVars::tv_root;
+    ThreadVars::tv_root = nullptr;
+    MutexUnlock(&tv_root_lock);
 
     while (tv) {
         ptv = tv;
         tv = tv->next;
         clear(ptv);
     }
-    ThreadVars::tv_root = nullptr;
 }
 
 /**
@@ -121,11 +121,13 @@ void TmThreads::clears()
  */
 void TmThreads::append(ThreadVars *tv)
 {
+    MutexLock(&tv_root_lock);
     if (ThreadVars::tv_root == nullptr) {
         ThreadVars::tv_root = tv;
         tv->next = nullptr;
         tv->prev = nullptr;
 
+        MutexUnlock(&tv_root_lock);
         return;
     }
 
@@ -141,6 +143,65 @@ void TmThreads::append(ThreadVars *tv)
 
         t = t->next;
     }
+    MutexUnlock(&tv_root_lock);
+}
+
+/**
+ * \brief Removes this TV from tv_root, the thread itself is not touched
+ */
+void TmThreads::unlink(ThreadVars *tv)
+{
+    MutexLock(&tv_root_lock);
+    if (tv->prev)
+        tv->prev->next = tv->next;
+    else if (ThreadVars::tv_root == tv)
+        ThreadVars::tv_root = tv->next;
+
+    if (tv->next)
+        tv->next->prev = tv->prev;
+
+    tv->next = nullptr;
+    tv->prev = nullptr;
+    MutexUnlock(&tv_root_lock);
+}
+
+/**
+ * \brief Stops a single running thread, removes it from tv_root and frees it
+ */
+void TmThreads::retire(ThreadVars *tv)
+{
+    kill(tv);
+    unlink(tv);
+    clear(tv);
+}
+
+/**
+ * \brief Finds a spawned thread by its name
+ *
+ * \retval nullptr if not found
+ */
+ThreadVars *TmThreads::lookup(const string &name)
+{
+    ThreadVars *tv;
+
+    MutexLock(&tv_root_lock);
+    for (tv = ThreadVars::tv_root; tv; tv = tv->next) {
+        if (tv->name == name)
+            break;
+    }
+    MutexUnlock(&tv_root_lock);
+    return tv;
+}
+
+list<ThreadVars *> TmThreads::snapshot()
+{
+    list<ThreadVars *> tvs;
+
+    MutexLock(&tv_root_lock);
+    for (ThreadVars *tv = ThreadVars::tv_root; tv; tv = tv->next)
+        tvs.push_back(tv);
+    MutexUnlock(&tv_root_lock);
+    return tvs;
 }
 
 /**
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <list>
 #include "util-threads.h"
 
 class TmThreads{
@@ -17,5 +18,22 @@ public:
     static void clears();
 
     static void append(ThreadVars *tv);
+    static void unlink(ThreadVars *tv);
     static int spawn(ThreadVars *tv);
+    static void retire(ThreadVars *tv);
+
+    static ThreadVars *lookup(const string &name);
+
+    template<typename Func>
+    static void foreach(Func func)
+    {
+        for (auto tv: snapshot())
+            func(tv);
+    }
+
+private:
+    static std::list<ThreadVars *> snapshot();
+
+    /* threads may be spawned by other threads (e.g. reaper), protect tv_root */
+    static Mutex tv_root_lock;
 };
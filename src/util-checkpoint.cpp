@@ -0,0 +1,231 @@
+//
+// Created by YANHAI on 2020/1/19.
+//
+
+#include <cerrno>
+#include <unistd.h>
+#include "util-checkpoint.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define CHECKPOINT_MAGIC        "ACSCAN01"
+#define CHECKPOINT_MAGIC_LEN    8
+#define CHECKPOINT_BUFFER_SIZE  (1 << 20)
+#define CHECKPOINT_STRING_MAX   (1 << 16)
+
+/**
+ * 读取 journal, 数据不完整(最后一条记录写了一半)时 ok 为 false
+ */
+class CheckpointReader {
+public:
+    explicit CheckpointReader(FILE *fp) : fp(fp), ok(true)
+    {}
+
+    template<typename T>
+    T value()
+    {
+        T v = T();
+        if (ok && fread(&v, sizeof(v), 1, fp) != 1)
+            ok = false;
+        return v;
+    }
+
+    string str()
+    {
+        auto len = value<uint32_t>();
+        if (!ok || len > CHECKPOINT_STRING_MAX) {
+            ok = false;
+            return string();
+        }
+        string s(len, '\0');
+        if (len && fread(&s[0], 1, len, fp) != len)
+            ok = false;
+        return s;
+    }
+
+    FILE *fp;
+    bool ok;
+};
+
+ScanCheckpoint::ScanCheckpoint(const string &path) : file_path(path)
+{
+    fp = nullptr;
+    failed = false;
+}
+
+ScanCheckpoint::~ScanCheckpoint()
+{
+    close();
+}
+
+void ScanCheckpoint::close()
+{
+    if (!fp)
+        return;
+    if (fclose(fp) != 0)
+        failed = true;
+    fp = nullptr;
+}
+
+bool ScanCheckpoint::resume(const string &directory, const string &fingerprint, time_t max_age, const Replay &replay)
+{
+    char magic[CHECKPOINT_MAGIC_LEN];
+
+    close();
+    fp = fopen(file_path.c_str(), "r+e");
+    if (!fp)
+        return false;
+
+    CheckpointReader reader(fp);
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+        spdlog::warn("scan checkpoint {} is not valid, ignore it", file_path);
+        close();
+        return false;
+    }
+    auto started = reader.value<int64_t>();
+    auto dir = reader.str();
+    auto fp_str = reader.str();
+    if (!reader.ok || dir != directory || fp_str != fingerprint || time(nullptr) - started > max_age) {
+        spdlog::info("scan checkpoint {} is stale, scan {} from the start", file_path, directory);
+        close();
+        return false;
+    }
+
+    // 逐条读取, 只应用有提交记录的目录
+    vector<FileNode> files;
+    vector<string> subdirs;
+    long committed = ftell(fp);
+    unsigned long dirs = 0;
+    while (reader.ok) {
+        int type = fgetc(fp);
+        if (type == EOF)
+            break;
+        if (type == 'F') {
+            FileNode node;
+            node.path = reader.str();
+            node.mtime = (time_t) reader.value<int64_t>();
+            node.size = (off_t) reader.value<int64_t>();
+            node.alloc = (off_t) reader.value<int64_t>();
+            node.dev = (dev_t) reader.value<uint64_t>();
+            node.ino = (ino_t) reader.value<uint64_t>();
+            node.nlink = (nlink_t) reader.value<uint32_t>();
+            node.links = (nlink_t) reader.value<uint32_t>();
+            node.coarse = reader.value<uint8_t>() != 0;
+            node.dir = nullptr;
+            node.atime = node.mtime;    // 访问不写入 journal, 下次删除前的 stat 再发现
+            node.hits = 0;
+            node.priority = 0;
+            files.push_back(std::move(node));
+        } else if (type == 'S') {
+            subdirs.push_back(reader.str());
+        } else if (type == 'D') {
+            auto path = reader.str();
+            if (!reader.ok)
+                break;
+            if (!replay(path, files, subdirs)) {
+                spdlog::warn("scan checkpoint {} does not match the walk at {}, ignore it", file_path, path);
+                close();
+                return false;
+            }
+            files.clear();
+            subdirs.clear();
+            committed = ftell(fp);
+            dirs++;
+        } else {
+            reader.ok = false;
+        }
+    }
+
+    // 丢弃没有提交的部分, 之后从这里继续追加
+    if (fflush(fp) != 0 || ftruncate(fileno(fp), committed) != 0 || fseek(fp, committed, SEEK_SET) != 0) {
+        spdlog::warn("truncate scan checkpoint {} failed: {}", file_path, strerror(errno));
+        close();
+        return false;
+    }
+    setvbuf(fp, nullptr, _IOFBF, CHECKPOINT_BUFFER_SIZE);
+    failed = false;
+    spdlog::info("resume scan of {} from checkpoint {}, {} directories done", directory, file_path, dirs);
+    return true;
+}
+
+bool ScanCheckpoint::start(const string &directory, const string &fingerprint)
+{
+    close();
+    failed = false;
+    fp = fopen(file_path.c_str(), "we");
+    if (!fp) {
+        spdlog::warn("create scan checkpoint {} failed: {}", file_path, strerror(errno));
+        return false;
+    }
+    setvbuf(fp, nullptr, _IOFBF, CHECKPOINT_BUFFER_SIZE);
+
+    if (fwrite(CHECKPOINT_MAGIC, 1, CHECKPOINT_MAGIC_LEN, fp) != CHECKPOINT_MAGIC_LEN)
+        failed = true;
+    write_value<int64_t>(time(nullptr));
+    write_string(directory);
+    write_string(fingerprint);
+    return !failed;
+}
+
+void ScanCheckpoint::write_string(const string &s)
+{
+    write_value<uint32_t>((uint32_t) s.length());
+    if (!s.empty() && fwrite(s.data(), 1, s.length(), fp) != s.length())
+        failed = true;
+}
+
+void ScanCheckpoint::write_type(char type)
+{
+    if (fputc(type, fp) == EOF)
+        failed = true;
+}
+
+void ScanCheckpoint::file(const string &name, const FileNode &node)
+{
+    if (!fp || failed)
+        return;
+    write_type('F');
+    write_string(name);
+    write_value<int64_t>(node.mtime);
+    write_value<int64_t>(node.size);
+    write_value<int64_t>(node.alloc);
+    write_value<uint64_t>(node.dev);
+    write_value<uint64_t>(node.ino);
+    write_value<uint32_t>((uint32_t) node.nlink);
+    write_value<uint32_t>((uint32_t) node.links);
+    write_value<uint8_t>(node.coarse);
+}
+
+void ScanCheckpoint::subdir(const string &name)
+{
+    if (!fp || failed)
+        return;
+    write_type('S');
+    write_string(name);
+}
+
+void ScanCheckpoint::commit(const string &dir)
+{
+    if (!fp || failed)
+        return;
+    write_type('D');
+    write_string(dir);
+}
+
+void ScanCheckpoint::suspend()
+{
+    if (!fp)
+        return;
+    close();
+    if (failed)
+        spdlog::warn("scan checkpoint {} is incomplete, the scan resumes from where it stopped being written",
+                     file_path);
+}
+
+void ScanCheckpoint::finish()
+{
+    close();
+    if (unlink(file_path.c_str()) != 0 && errno != ENOENT)
+        spdlog::warn("remove scan checkpoint {} failed: {}", file_path, strerror(errno));
+}
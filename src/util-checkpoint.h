@@ -0,0 +1,87 @@
+//
+// Created by YANHAI on 2020/1/19.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include "util-file.h"
+
+/**
+ * \brief Journal of a scan in progress, an interrupted scan resumes from it after a restart
+ *
+ * The scan walks directories depth first. For every directory read it appends the files found
+ * and the sub directories pushed on the stack, then a commit record. Replaying the
+ * committed directories gives back the queue and the stack as they were, a directory whose
+ * commit record is missing (crash in the middle) is read again.
+ * The journal is removed when the scan completes, it only exists for an unfinished scan.
+ *
+ * Format (host byte order): header "ACSCAN01", time, directory, fingerprint, then records
+ * 'F' file, 'S' sub directory (both by name), 'D' commit of a directory by path.
+ * Strings are a 32 bit length + bytes.
+ */
+class ScanCheckpoint {
+public:
+    typedef std::function<bool(const string &dir, vector<FileNode> &files, vector<string> &subdirs)> Replay;
+
+    explicit ScanCheckpoint(const string &path);
+
+    ~ScanCheckpoint();
+
+    const string &path() const
+    {
+        return file_path;
+    }
+
+    /**
+     * \brief Replay the journal of an unfinished scan of directory and keep appending to it
+     *
+     * The journal is ignored if it is older than max_age or was written for another directory
+     * or fingerprint (options that change what a scan puts in the queue).
+     * @param replay called for each committed directory in scan order with the files (path is the
+     *               name, dir is not set) and sub directory names, returns false to give up
+     * \retval false no usable journal, nothing was replayed, call start()
+     */
+    bool resume(const string &directory, const string &fingerprint, time_t max_age, const Replay &replay);
+
+    /**
+     * \brief Begin the journal of a new scan, an old one is discarded
+     */
+    bool start(const string &directory, const string &fingerprint);
+
+    void file(const string &name, const FileNode &node);
+
+    void subdir(const string &name);
+
+    void commit(const string &dir);
+
+    /**
+     * \brief Scan interrupted, flush and keep the journal for the next start
+     */
+    void suspend();
+
+    /**
+     * \brief Scan completed, remove the journal
+     */
+    void finish();
+
+private:
+    void write_string(const string &s);
+
+    void write_type(char type);
+
+    template<typename T>
+    void write_value(T value)
+    {
+        if (fwrite(&value, sizeof(value), 1, fp) != 1)
+            failed = true;
+    }
+
+    void close();
+
+private:
+    string file_path;
+    FILE *fp;
+    bool failed;    // a write failed (disk full?), stop writing, what was written is still a valid prefix
+};
@@ -0,0 +1,218 @@
+//
+// Created by YANHAI on 2020/1/10.
+//
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "util-dirtree.h"
+
+using namespace std;
+
+DirTree::DirTree(const string &root) : root_path(root)
+{
+    MutexInit(&lock, nullptr);
+    this->root = create(nullptr, root);
+}
+
+DirTree::~DirTree()
+{
+    free(root);
+    MutexDestroy(&lock);
+}
+
+DirNode *DirTree::create(DirNode *parent, const string &name)
+{
+    auto node = new DirNode{name, parent, map<string, DirNode *>(), 0, 0, 0, 0, false, 0, 0, 0, 0, false};
+    if (parent)
+        parent->children[name] = node;
+    return node;
+}
+
+void DirTree::free(DirNode *node)
+{
+    for (auto &it: node->children)
+        free(it.second);
+    delete node;
+}
+
+DirNode *DirTree::node(const string &dir)
+{
+    MutexLock(&lock);
+    DirNode *node = root;
+    size_t begin = root_path.length() + 1;
+    while (begin < dir.length()) {
+        auto end = dir.find('/', begin);
+        if (end == string::npos)
+            end = dir.length();
+        auto name = dir.substr(begin, end - begin);
+        auto it = node->children.find(name);
+        node = it != node->children.end() ? it->second : create(node, name);
+        begin = end + 1;
+    }
+    MutexUnlock(&lock);
+    return node;
+}
+
+void DirTree::add(DirNode *node, off_t size, time_t mtime)
+{
+    MutexLock(&lock);
+    node->own_bytes += size;
+    node->own_files += 1;
+    if (node->own_files == 1 || mtime < node->own_oldest)
+        node->own_oldest = mtime;
+    if (node->own_files == 1 || mtime > node->own_newest)
+        node->own_newest = mtime;
+
+    for (auto n = node; n; n = n->parent) {
+        n->bytes += size;
+        n->files += 1;
+        if (n->files == 1 || mtime < n->oldest)
+            n->oldest = mtime;
+        if (n->files == 1 || mtime > n->newest)
+            n->newest = mtime;
+    }
+    MutexUnlock(&lock);
+}
+
+void DirTree::remove(DirNode *node, off_t size, time_t mtime)
+{
+    MutexLock(&lock);
+    node->own_bytes -= size;
+    node->own_files -= 1;
+    if (node->own_files == 0) {
+        node->own_oldest = node->own_newest = 0;
+        node->own_stale = false;
+    } else if (mtime <= node->own_oldest || mtime >= node->own_newest) {
+        node->own_stale = true;
+    }
+
+    for (auto n = node; n; n = n->parent) {
+        n->bytes -= size;
+        n->files -= 1;
+        if (n->files == 0) {
+            n->oldest = n->newest = 0;
+            n->stale = false;
+        } else if (mtime <= n->oldest || mtime >= n->newest) {
+            n->stale = true;
+        }
+    }
+
+    prune(node);
+    MutexUnlock(&lock);
+}
+
+void DirTree::clear()
+{
+    MutexLock(&lock);
+    free(root);
+    root = create(nullptr, root_path);
+    MutexUnlock(&lock);
+}
+
+/**
+ * 没有文件的目录从树中删除, 内存只和有文件的目录数相关
+ */
+void DirTree::prune(DirNode *node)
+{
+    while (node != root && node->files == 0 && node->children.empty()) {
+        auto parent = node->parent;
+        parent->children.erase(node->name);
+        delete node;
+        node = parent;
+    }
+}
+
+string DirTree::path_of(const DirNode *node) const
+{
+    if (node == root)
+        return root_path;
+    return path_of(node->parent) + "/" + node->name;
+}
+
+/**
+ * 重新计算 stale 节点的 oldest/newest, 本目录的文件需要重新读取目录
+ */
+void DirTree::refresh(DirNode *node)
+{
+    if (!node->stale && !node->own_stale)
+        return;
+
+    if (node->own_stale) {
+        auto dir = path_of(node);
+        DIR *d = opendir(dir.c_str());
+        if (d) {
+            struct dirent *ent;
+            struct stat st;
+            bool found = false;
+            while ((ent = readdir(d)) != nullptr) {
+                if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+                    continue;
+                if (!found || st.st_mtime < node->own_oldest)
+                    node->own_oldest = st.st_mtime;
+                if (!found || st.st_mtime > node->own_newest)
+                    node->own_newest = st.st_mtime;
+                found = true;
+            }
+            closedir(d);
+        }
+        node->own_stale = false;
+    }
+
+    bool found = node->own_files > 0;
+    node->oldest = node->own_oldest;
+    node->newest = node->own_newest;
+    for (auto &it: node->children) {
+        auto child = it.second;
+        refresh(child);
+        if (child->files == 0)
+            continue;
+        if (!found || child->oldest < node->oldest)
+            node->oldest = child->oldest;
+        if (!found || child->newest > node->newest)
+            node->newest = child->newest;
+        found = true;
+    }
+    node->stale = false;
+}
+
+void DirTree::to_json(DirNode *node, const string &path, unsigned int depth, Json::Value &result)
+{
+    result["path"] = path;
+    result["bytes"] = (Json::Int64) node->bytes;
+    result["files"] = (Json::UInt64) node->files;
+    result["oldest"] = (Json::Int64) node->oldest;
+    result["newest"] = (Json::Int64) node->newest;
+
+    if (depth == 0)
+        return;
+
+    auto &children = result["children"] = Json::Value(Json::arrayValue);
+    for (auto &it: node->children) {
+        Json::Value child;
+        to_json(it.second, path + "/" + it.first, depth - 1, child);
+        children.append(child);
+    }
+}
+
+bool DirTree::query(const string &prefix, unsigned int depth, Json::Value &result)
+{
+    MutexLock(&lock);
+    DirNode *node = root;
+    size_t begin = root_path.length() + 1;
+    while (node && begin < prefix.length()) {
+        auto end = prefix.find('/', begin);
+        if (end == string::npos)
+            end = prefix.length();
+        auto it = node->children.find(prefix.substr(begin, end - begin));
+        node = it != node->children.end() ? it->second : nullptr;
+        begin = end + 1;
+    }
+
+    if (node) {
+        refresh(node);
+        to_json(node, path_of(node), depth, result);
+    }
+    MutexUnlock(&lock);
+    return node != nullptr;
+}
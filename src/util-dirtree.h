@@ -0,0 +1,89 @@
+//
+// Created by YANHAI on 2020/1/10.
+//
+
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <json/json.h>
+#include "util-threads.h"
+
+/**
+ * 目录节点, 统计值包含所有子目录
+ */
+struct DirNode {
+    string name;
+    DirNode *parent;
+    map<string, DirNode *> children;
+
+    // 包含子目录
+    off_t bytes;
+    unsigned long files;
+    time_t oldest;
+    time_t newest;
+    bool stale;         // oldest/newest 可能不准确, 查询时重新计算
+
+    // 仅本目录中的文件
+    off_t own_bytes;
+    unsigned long own_files;
+    time_t own_oldest;
+    time_t own_newest;
+    bool own_stale;
+};
+
+/**
+ * \brief Directory size aggregation of the files in a FileCtx index
+ *
+ * Updated incrementally when files enter or leave the index, so "du" of a prefix is a memory
+ * lookup. oldest/newest are exact on insert; removing the oldest or newest file of a directory
+ * marks it stale and only that directory is re-read when it is queried.
+ * Safe to query from other threads.
+ */
+class DirTree {
+public:
+    DirTree(const string &root);
+
+    ~DirTree();
+
+    /**
+     * \brief Node of a directory under root, created if it does not exist
+     */
+    DirNode *node(const string &dir);
+
+    void add(DirNode *node, off_t size, time_t mtime);
+
+    void remove(DirNode *node, off_t size, time_t mtime);
+
+    /**
+     * \brief Drop all nodes before a rescan, nodes returned before are invalid
+     */
+    void clear();
+
+    /**
+     * \brief du
+     * \param prefix directory under root
+     * \param depth levels of sub directories in the result
+     * \retval false if prefix is not in the tree
+     */
+    bool query(const string &prefix, unsigned int depth, Json::Value &result);
+
+private:
+    DirNode *create(DirNode *parent, const string &name);
+
+    void prune(DirNode *node);
+
+    void free(DirNode *node);
+
+    void refresh(DirNode *node);
+
+    string path_of(const DirNode *node) const;
+
+    void to_json(DirNode *node, const string &path, unsigned int depth, Json::Value &result);
+
+private:
+    string root_path;
+    DirNode *root;
+    Mutex lock;
+};
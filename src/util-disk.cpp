@@ -3,8 +3,18 @@
 //
 
 #include <iostream>
+#include <cerrno>
 #include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/timerfd.h>
 #include "util-disk.h"
+#include "util-reactor.h"
+#include "util-trace.h"
+#include "util/log.h"
 
 using namespace std;
 
@@ -12,7 +22,8 @@ int Disk::setMountPoint()
 {
     int r;
     char cmd[1024];
-    char buffer[4096];
+    char buffer[4096] = "";
+    TraceSpan span("df", &_path);
 
     snprintf(cmd, sizeof(cmd), "df %s | grep ^/dev/ | awk '{print $6}'", _path.c_str());
     r = GetShellCmdRetVal(cmd, buffer, sizeof(buffer));
@@ -20,6 +31,7 @@ int Disk::setMountPoint()
         return -1;
     }
 
+    buffer[strcspn(buffer, "\r\n")] = '\0';
     _mount_point = buffer;
     return 0;
 }
@@ -47,33 +59,34 @@ off_t Disk::totalBytes()
 
 int Disk::GetTotal()
 {
-    int r;
-    char cmd[1024];
-    char buffer[1024];
+    struct statvfs st;
 
-    snprintf(cmd, sizeof(cmd), "df --block-size=1 %s | grep ^/dev/ | awk '{print $2}'", _path.c_str());
-    r = GetShellCmdRetVal(cmd, buffer, sizeof(buffer));
-    if (r != 0) {
+    if (statvfs(_path.c_str(), &st) != 0)
         return 0;
-    }
 
-    _total = atol(buffer);
+    _total = (off_t) st.f_blocks * st.f_frsize;
     return 1;
 }
 
+/**
+ * 和 df 的 Use% 相同: used / (used + avail) 向上取整, 每次 loop 都调用, 不再 fork df
+ */
 short Disk::usedPercentage()
 {
-    int r;
-    char cmd[1024];
-    char buffer[1024];
+    struct statvfs st;
+    TraceSpan span("disk", &_path);
 
-    snprintf(cmd, sizeof(cmd), "df %s | grep ^/dev/ | awk '{print $5}'", _path.c_str());
-    r = GetShellCmdRetVal(cmd, buffer, sizeof(buffer));
-    if (r != 0) {
+    if (statvfs(_path.c_str(), &st) != 0)
+        return 0;
+
+    unsigned long long used = st.f_blocks - st.f_bfree;
+    unsigned long long total = used + st.f_bavail;
+    if (total == 0)
         return 0;
-    }
 
-    return atoi(buffer);
+    auto percent = (short) ((used * 100 + total - 1) / total);
+    TRACE_PROBE(disk__probe, _path.c_str(), percent);
+    return percent;
 }
 
 off_t Disk::deleteBytes()
@@ -87,10 +100,70 @@ off_t Disk::deleteBytes()
     }
 
     delete_percent = used - _used_threshold;
-    delete_bytes = _total * 1.0 * (delete_percent + (short) 1) / 100;
+    delete_bytes = totalBytes() * 1.0 * (delete_percent + (short) 1) / 100;
     return (off_t) delete_bytes;
 }
 
+static short inode_percent(const struct statvfs &st)
+{
+    if (st.f_files == 0)
+        return 0;
+    unsigned long long used = st.f_files - st.f_ffree;
+    return (short) ((used * 100 + st.f_files - 1) / st.f_files);
+}
+
+short Disk::inodePercentage()
+{
+    struct statvfs st;
+
+    if (statvfs(_path.c_str(), &st) != 0)
+        return 0;
+    return inode_percent(st);
+}
+
+unsigned long Disk::deleteInodes()
+{
+    struct statvfs st;
+
+    if (_inode_threshold <= 0 || statvfs(_path.c_str(), &st) != 0)
+        return 0;
+    if (inode_percent(st) < _inode_threshold)
+        return 0;
+
+    unsigned long long used = st.f_files - st.f_ffree;
+    unsigned long long target = st.f_files * (unsigned long long) _inode_safe / 100;
+    return used > target ? (unsigned long) (used - target) : 0;
+}
+
+off_t Disk::freeBytes()
+{
+    struct statvfs st;
+
+    if (statvfs(_path.c_str(), &st) != 0)
+        return 0;
+
+    return (off_t) st.f_bavail * st.f_frsize;
+}
+
+bool Disk::noatime()
+{
+    struct statvfs st;
+
+    if (statvfs(_path.c_str(), &st) != 0)
+        return false;
+    return (st.f_flag & ST_NOATIME) != 0;
+}
+
+dev_t Disk::device()
+{
+    struct stat st;
+
+    if (stat(_path.c_str(), &st) != 0)
+        return 0;
+
+    return st.st_dev;
+}
+
 int Disk::GetShellCmdRetVal(const char *cmd, char *result, size_t result_len)
 {
     char buf_ps[1024];
@@ -125,3 +198,194 @@ int Disk::GetShellCmdRetVal(const char *cmd, char *result, size_t result_len)
 
     return 0;
 }
+
+Mutex Ballast::ballasts_lock = MUTEX_INITIALIZER;
+map<string, Ballast *> Ballast::ballasts;
+int Ballast::timer_fd = -1;
+
+Ballast::Ballast(const string &mount_point) : disk(mount_point, 0)
+{
+    path = mount_point;
+    if (path.empty() || path[path.length() - 1] != '/')
+        path += "/";
+    path += DISK_BALLAST_FILE;
+    size = 0;
+    critical = 0;
+    safe = 0;
+    failed = false;
+    releases = 0;
+    released_at = 0;
+    MutexInit(&lock, nullptr);
+
+    // 上次运行留下的完整分配的 ballast 继续使用, 不完整的重新分配
+    struct stat st;
+    allocated = 0;
+    if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (off_t) st.st_blocks * 512 >= st.st_size)
+        allocated = st.st_size;
+}
+
+Ballast *Ballast::instance(const string &mount_point)
+{
+    MutexLock(&ballasts_lock);
+    auto &ballast = ballasts[mount_point];
+    if (!ballast)
+        ballast = new Ballast(mount_point);
+    MutexUnlock(&ballasts_lock);
+    return ballast;
+}
+
+void Ballast::configure(const string &owner, off_t size, short critical, short safe)
+{
+    MutexLock(&lock);
+    if (size > 0)
+        requests[owner] = Request{size, critical, safe};
+    else
+        requests.erase(owner);
+
+    this->size = 0;
+    this->critical = 0;
+    this->safe = 0;
+    for (auto &it: requests) {
+        auto &r = it.second;
+        this->size = std::max(this->size, r.size);
+        if (this->critical == 0 || r.critical < this->critical)
+            this->critical = r.critical;
+        if (this->safe == 0 || r.safe < this->safe)
+            this->safe = r.safe;
+    }
+    failed = false;
+
+    // 不再需要时删除, 缩小在下次 update 时
+    if (this->size == 0 && allocated > 0) {
+        if (unlink(path.c_str()) == 0 || errno == ENOENT) {
+            spdlog::info("ballast {} removed", path);
+            allocated = 0;
+        }
+    }
+    MutexUnlock(&lock);
+
+    // 第一次配置时启动定时器, 没有 ballast 时主线程不会因为它被唤醒
+    if (size > 0 && timer_fd >= 0) {
+        struct itimerspec its = {};
+        timerfd_gettime(timer_fd, &its);
+        if (its.it_interval.tv_nsec == 0 && its.it_interval.tv_sec == 0) {
+            its.it_interval.tv_sec = BALLAST_CHECK_INTERVAL / 1000;
+            its.it_interval.tv_nsec = (BALLAST_CHECK_INTERVAL % 1000) * 1000000L;
+            its.it_value = its.it_interval;
+            timerfd_settime(timer_fd, 0, &its, nullptr);
+        }
+    }
+}
+
+void Ballast::drop(const string &owner)
+{
+    MutexLock(&ballasts_lock);
+    for (auto &it: ballasts)
+        it.second->configure(owner, 0);
+    MutexUnlock(&ballasts_lock);
+}
+
+void Ballast::update()
+{
+    MutexLock(&lock);
+    short used = disk.usedPercentage();
+    if (allocated > 0 && critical > 0 && used >= critical) {
+        release(used);
+    } else if (size > 0 && allocated != size && !failed) {
+        // 分配后仍然低于 safe 才分配, 否则分配本身就会触发清理
+        auto total = disk.totalBytes();
+        off_t grow = size - allocated;
+        if (grow < 0 || (total > 0 && used + (grow * 100 + total - 1) / total < safe))
+            allocate(size);
+    }
+    MutexUnlock(&lock);
+}
+
+bool Ballast::watch()
+{
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        spdlog::warn("ballast timer: {}, check only in the clean loops", strerror(errno));
+        return false;
+    }
+
+    return Reactor::instance().watch(timer_fd, EPOLLIN, [](uint32_t) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return;
+        MutexLock(&ballasts_lock);
+        for (auto &it: ballasts)
+            it.second->update();
+        MutexUnlock(&ballasts_lock);
+    });
+}
+
+bool Ballast::allocate(off_t bytes)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        spdlog::warn("create ballast {} failed: {}", path, strerror(errno));
+        failed = true;
+        return false;
+    }
+
+    int r = bytes < allocated ? ftruncate(fd, bytes) : fallocate(fd, 0, 0, bytes);
+    int err = errno;
+    close(fd);
+    if (r != 0) {
+        spdlog::warn("allocate ballast {} {} bytes failed: {}", path, bytes, strerror(err));
+        // 不支持 fallocate 时不再重试; 空间不足时释放已分配的部分, 下次低于 safe 时重试
+        failed = err != ENOSPC;
+        unlink(path.c_str());
+        allocated = 0;
+        return false;
+    }
+
+    spdlog::info("ballast {} allocated: {} bytes", path, bytes);
+    allocated = bytes;
+    return true;
+}
+
+/**
+ * unlink 一个文件立即释放它的全部空间, 不经过回收站
+ */
+void Ballast::release(short used)
+{
+    TraceSpan span("ballast", &path);
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+        spdlog::error("release ballast {} failed: {}", path, strerror(errno));
+        return;
+    }
+    spdlog::warn("disk used {}%, ballast {} released: {} bytes", used, path, allocated);
+    allocated = 0;
+    releases++;
+    released_at = std::time(nullptr);
+}
+
+void Ballast::status(Json::Value &result)
+{
+    result = Json::Value(Json::arrayValue);
+    MutexLock(&ballasts_lock);
+    for (auto &it: ballasts) {
+        auto ballast = it.second;
+        Json::Value value;
+        MutexLock(&ballast->lock);
+        value["mount"] = it.first;
+        value["path"] = ballast->path;
+        value["size"] = (Json::Int64) ballast->size;
+        value["allocated"] = (Json::Int64) ballast->allocated;
+        if (ballast->failed)
+            value["state"] = "failed";
+        else if (ballast->size == 0)
+            value["state"] = "disabled";
+        else if (ballast->allocated == ballast->size)
+            value["state"] = "armed";
+        else
+            value["state"] = ballast->releases ? "released" : "pending";
+        value["releases"] = (Json::UInt64) ballast->releases;
+        value["released_at"] = (Json::Int64) ballast->released_at;
+        MutexUnlock(&ballast->lock);
+        result.append(value);
+    }
+    MutexUnlock(&ballasts_lock);
+}
@@ -5,9 +5,17 @@
 #pragma once
 
 #include <cstring>
+#include <map>
+#include <string>
+#include <json/json.h>
+#include "util-threads.h"
 
 using namespace std;
 
+/* per-mount ballast file, created at the mount point */
+#define DISK_BALLAST_FILE ".auto_clean_ballast"
+#define BALLAST_CHECK_INTERVAL 200  // ms, usage check of the ballasts by the main thread
+
 class Disk {
 public:
     Disk(const std::string &path, short threshold)
@@ -15,6 +23,8 @@ public:
     {
         _total = 0;
         _mount_point = "";
+        _inode_threshold = 0;
+        _inode_safe = 0;
     }
 
     const char *MountPoint();
@@ -23,8 +33,53 @@ public:
 
     short usedPercentage();
 
+    short threshold() const
+    {
+        return _used_threshold;
+    }
+
     off_t deleteBytes();
 
+    /**
+     * \brief Bytes available to unprivileged users (statvfs f_bavail)
+     */
+    off_t freeBytes();
+
+    /**
+     * \brief st_dev of the path, 0 on failure
+     */
+    dev_t device();
+
+    /**
+     * \brief Mounted with noatime, reads do not update st_atime
+     */
+    bool noatime();
+
+    void setThreshold(short threshold)
+    {
+        _used_threshold = threshold;
+    }
+
+    /**
+     * \brief 和 df -i 的 IUse% 相同, 没有固定 inode 数的文件系统(如 btrfs)为 0
+     */
+    short inodePercentage();
+
+    /**
+     * \brief inode 使用率达到 inode-limit 时, 降到 inode-safe 需要删除的文件数
+     */
+    unsigned long deleteInodes();
+
+    /**
+     * @param threshold inode-limit, 0 表示不检查 inode
+     * @param safe inode-safe
+     */
+    void setInodeThreshold(short threshold, short safe)
+    {
+        _inode_threshold = threshold;
+        _inode_safe = safe;
+    }
+
 private:
     int setMountPoint();
 
@@ -37,4 +92,86 @@ private:
     string _mount_point;
     off_t _total;
     short _used_threshold;
+    short _inode_threshold;
+    short _inode_safe;
+};
+
+/**
+ * \brief Preallocated (fallocate) file at the mount point that is given back at once when the
+ *        disk becomes critical
+ *
+ * Freeing one large file takes one unlink, while the cleaner may need to unlink thousands of
+ * small files to free the same space. The ballast buys that time: it is released when usage
+ * reaches the critical threshold and allocated again once usage is below safe and stays below
+ * safe with the ballast. The file survives restarts and is reused.
+ * Shared by the clean entries of a mount, its size is the largest one asked for, the thresholds
+ * are the lowest. Usage is checked by a timer of the main thread, so the release does not wait
+ * for a worker that sleeps or is busy deleting.
+ */
+class Ballast {
+protected:
+    explicit Ballast(const string &mount_point);
+
+public:
+    /**
+     * \brief Get the ballast of a mount point, created on first use
+     */
+    static Ballast *instance(const string &mount_point);
+
+    /**
+     * \brief Size a clean entry asks for, 0 to drop its request
+     * @param critical release at or above this percent
+     * @param safe allocate again below this percent
+     */
+    void configure(const string &owner, off_t size, short critical = 0, short safe = 0);
+
+    /**
+     * \brief Drop the requests of a clean entry that is removed or disabled, on every mount.
+     *        Workers stopped at exit keep their requests, the file is reused after a restart
+     */
+    static void drop(const string &owner);
+
+    /**
+     * \brief Release or allocate the ballast for the usage of the mount
+     */
+    void update();
+
+    /**
+     * \brief Check every ballast every BALLAST_CHECK_INTERVAL, on the reactor of the main thread.
+     *        The timer is armed once a ballast is configured
+     */
+    static bool watch();
+
+    /**
+     * \brief State of all ballasts, for the control socket
+     */
+    static void status(Json::Value &result);
+
+private:
+    bool allocate(off_t bytes);
+
+    void release(short used);
+
+private:
+    struct Request {
+        off_t size;
+        short critical;
+        short safe;
+    };
+
+    string path;
+    Disk disk;                  // the mount point
+    map<string, Request> requests;  // owner -> request
+    off_t size;                 // max of sizes
+    short critical;             // min of the requests
+    short safe;
+    off_t allocated;            // bytes of the file, 0 if released or not created
+    bool failed;                // fallocate not supported, do not retry
+    unsigned long releases;
+    time_t released_at;
+    Mutex lock;
+
+    static Mutex ballasts_lock;
+    static map<string, Ballast *> ballasts;
+    static int timer_fd;
 };
@@ -3,46 +3,712 @@
 //
 
 #include <regex>
+#include <algorithm>
+#include <iterator>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <ctime>
 #include <boost/timer/timer.hpp>
 #include <boost/date_time.hpp>
 
 #include "util/log.h"
 #include "util-file.h"
+#include "util-fileindex.h"
+#include "util-checkpoint.h"
+#include "util-disk.h"
+#include "util-planner.h"
+#include "util-policy.h"
+#include "util-trace.h"
+
+#define SCAN_CHECKPOINT_MAX_AGE 3600    // seconds, an older journal is ignored
+#define RESCAN_CLOSED_GRACE 3600        // seconds after the end of a date directory until it is pruned
+#define RESCAN_MAX_BACKOFF 3            // a quiet subtree is visited at least every 2^3 rescans
+#define INODE_WINDOW_FACTOR 2           // inode eviction picks from the oldest count * 2 files
 
 FileCtx::FileCtx(const std::string &directory, unsigned int limit, unsigned int safe, unsigned long timeout,
-                 bool emptydir)
+                 bool emptydir, size_t hash_size)
 {
     this->directory = directory;
+    while (this->directory.length() > 1 && this->directory[this->directory.length() - 1] == '/')
+        this->directory.erase(this->directory.length() - 1);
     this->limit = limit;
     this->safe = safe;
     this->timeout = timeout;
     this->emptydir = emptydir;
+    locality = false;
+    scan_budget = 0;
+    path_time = false;
+    reaper = nullptr;
+    open_files = nullptr;
+    checkpoint = nullptr;
+    rescan_enabled = false;
+    rescans = 0;
+    memset(&rescan_stats, 0, sizeof(rescan_stats));
+    policy = nullptr;
+    memset(&policy_stats, 0, sizeof(policy_stats));
+    unlink_window = 0;
+    memset(&unlink_stats, 0, sizeof(unlink_stats));
+    share_depth = 0;
+    files = 0;
+    dirtree = new DirTree(this->directory);
+    index = new FileIndex(hash_size);
     d_dir = 0;
     d_file = 0;
+    memset(&scan_errors, 0, sizeof(scan_errors));
+    generation = 0;
+    MutexInit(&plan_mutex, nullptr);
+    plan_snapshot = make_shared<const EvictionPlan>(vector<EvictionPlan::Part>());
+}
+
+FileCtx::~FileCtx()
+{
+    MutexDestroy(&plan_mutex);
+    delete policy;
+    delete checkpoint;
+    delete index;
+    delete dirtree;
+}
+
+void FileCtx::reconfigure(unsigned int limit, unsigned int safe, unsigned long timeout, bool emptydir)
+{
+    this->limit = limit;
+    this->safe = safe;
+    this->timeout = timeout;
+    this->emptydir = emptydir;
+}
+
+void FileCtx::set_scan_budget(size_t budget)
+{
+    if (budget == scan_budget)
+        return;
+
+    // 已扫描的队列是按旧的预算截断的, 下次 loop 时重新扫描
+    scan_budget = budget;
+    reset();
+}
+
+void FileCtx::set_path_time(bool path_time)
+{
+    if (path_time == this->path_time)
+        return;
+
+    this->path_time = path_time;
+    reset();
+}
+
+void FileCtx::set_checkpoint(const string &path)
+{
+    if (checkpoint && checkpoint->path() == path)
+        return;
+
+    delete checkpoint;
+    checkpoint = path.empty() ? nullptr : new ScanCheckpoint(path);
+}
+
+void FileCtx::set_rescan(bool rescan)
+{
+    if (rescan == rescan_enabled)
+        return;
+
+    // 目录状态在完整扫描时记录
+    rescan_enabled = rescan;
+    reset();
+}
+
+bool FileCtx::set_policy(const string &name)
+{
+    bool known;
+    if (policy && name == policy->name())
+        return true;
+
+    // 同一个 policy 保留排序(gdsf 的 L), 改变后按新的 priority 重建, 不需要重新扫描
+    auto next = EvictionPolicy::create(name, known);
+    if (!policy && !next)
+        return known;
+    delete policy;
+    policy = next;
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        subtree.ranked.clear();
+        for (auto node = subtree.queue.begin(); node != subtree.queue.end(); ++node)
+            rank(subtree, node);
+    }
+    spdlog::info("{}: eviction policy {}", directory, policy ? policy->name() : "fifo");
+    return known;
+}
+
+bool FileCtx::exhausted() const
+{
+    if (files == 0)
+        return true;
+    for (auto &it: subtrees) {
+        if (it.second.truncated && it.second.queue.empty())
+            return true;
+    }
+    return false;
+}
+
+/**
+ * 清空队列和目录统计, 重新扫描前调用
+ */
+void FileCtx::reset()
+{
+    index->clear();
+    links.clear();
+    subtrees.clear();
+    files = 0;
+    dirtree->clear();
+    dir_states.clear();
+}
+
+void FileCtx::set_shares(const Json::Value &shares, unsigned int depth)
+{
+    this->shares = shares;
+
+    if (depth == share_depth) {
+        for (auto &it: subtrees)
+            it.second.weight = share_weight(it.first);
+        return;
+    }
+
+    // 截断的队列不包含子目录的所有文件, 无法重新划分, 重新扫描
+    if (scan_budget > 0) {
+        share_depth = depth;
+        reset();
+        return;
+    }
+
+    // 重新划分子目录, 不需要重新扫描
+    list<FileNode> nodes;
+    for (auto &it: subtrees)
+        nodes.splice(nodes.end(), it.second.queue);
+    subtrees.clear();
+    files = 0;
+    share_depth = depth;
+
+    index->clear();
+    while (!nodes.empty()) {
+        auto &node = nodes.front();
+        auto &subtree = subtree_of(node.path.substr(0, node.path.rfind('/')));
+        subtree.bytes += node.alloc;
+        subtree.queue.splice(subtree.queue.end(), nodes, nodes.begin());
+        index->insert(&subtree, std::prev(subtree.queue.end()));
+        files++;
+    }
+    sort();
+}
+
+unsigned int FileCtx::share_weight(const string &name) const
+{
+    auto &weight = shares.isObject() && shares.isMember(name) ? shares[name] : shares["*"];
+    return weight.isNull() ? 1 : std::max(weight.asUInt(), 1u);
+}
+
+/**
+ * 目录所属的子目录, dir 为 directory 本身或者其下的目录
+ */
+Subtree &FileCtx::subtree_of(const string &dir)
+{
+    string name;
+
+    if (share_depth > 0 && dir.length() > directory.length()) {
+        auto begin = directory.length() + 1;
+        auto end = begin;
+        for (unsigned int i = 0; i < share_depth && end != string::npos; i++)
+            end = dir.find('/', end + 1);
+        name = dir.substr(begin, end == string::npos ? string::npos : end - begin);
+    }
+
+    auto it = subtrees.find(name);
+    if (it == subtrees.end()) {
+        it = subtrees.insert(make_pair(name, Subtree{name, share_weight(name), 0, list<FileNode>(),
+                                                     vector<FileNode>(), false, ++generation,
+                                                     set<list<FileNode>::iterator, RankLess>()})).first;
+    }
+    return it->second;
+}
+
+/**
+ * 清理程序自己的目录和文件(回收站, ballast), 扫描时跳过
+ */
+static inline bool skip_entry(const char *name)
+{
+    return !strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, REAPER_TRASH_DIR) ||
+           !strcmp(name, DISK_BALLAST_FILE);
+}
+
+static FileNode make_node(string path, const struct stat &st, DirNode *dir)
+{
+    // 修改后读取过的文件算一次访问
+    return FileNode{std::move(path), st.st_mtime, st.st_size, (off_t) st.st_blocks * 512, st.st_dev, st.st_ino,
+                    st.st_nlink, 1, dir, false, st.st_atime, st.st_atime > st.st_mtime ? 1u : 0u, 0};
+}
+
+/**
+ * 解析 n 个十进制数字, 有非数字时返回 -1. 没有分支, 编译器可以向量化
+ */
+static inline int parse_digits(const char *p, size_t n)
+{
+    int value = 0;
+    unsigned int bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int d = (unsigned char) p[i] - '0';
+        bad |= d > 9;
+        value = value * 10 + (int) d;
+    }
+    return bad ? -1 : value;
+}
+
+/**
+ * 目录路径中的时间范围 [begin, end), 如 smtp/log/2018/05/29/03 为 2018-05-29 03:00 开始的一小时
+ * 支持逐级的 yyyy/mm/dd/hh/MM 以及 yyyymmdd, yyyymmddhh 目录, 日期之后的目录继承它的范围. 按本地时间解析
+ * @param from 从该位置开始查找, 跳过 path 本身
+ * @return false 没有精确到天的日期
+ */
+static bool path_time_range(const string &dir, size_t from, time_t &begin, time_t &end)
+{
+    static const int max_value[] = {2200, 12, 31, 23, 59};
+    static const int min_value[] = {1970, 1, 1, 0, 0};
+    int fields[5] = {0, 1, 1, 0, 0};
+    int level = 0;
+
+    for (size_t pos = from; pos < dir.length() && level < 5;) {
+        if (dir[pos] == '/') {
+            pos++;
+            continue;
+        }
+        size_t next = dir.find('/', pos);
+        if (next == string::npos)
+            next = dir.length();
+        const char *p = dir.c_str() + pos;
+        size_t len = next - pos;
+        pos = next;
+
+        if (level == 0) {
+            // 日期之前的目录(如 smtp/log)跳过, 日期可以是 yyyy, yyyymmdd 或 yyyymmddhh
+            if (len != 4 && len != 8 && len != 10)
+                continue;
+            int year = parse_digits(p, 4);
+            if (year < min_value[0] || year > max_value[0])
+                continue;
+            fields[level++] = year;
+            for (size_t i = 4; i < len && level > 0; i += 2) {
+                int value = parse_digits(p + i, 2);
+                if (value < min_value[level] || value > max_value[level])
+                    level = 0;
+                else
+                    fields[level++] = value;
+            }
+            continue;
+        }
+
+        int value = len == 2 ? parse_digits(p, 2) : -1;
+        if (value < min_value[level] || value > max_value[level])
+            break;
+        fields[level++] = value;
+    }
+
+    if (level < 3)
+        return false;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_hour = fields[3];
+    tm.tm_min = fields[4];
+    tm.tm_isdst = -1;
+
+    // 最后一级加一, mktime 处理进位
+    struct tm next = tm;
+    if (level == 3)
+        next.tm_mday++;
+    else if (level == 4)
+        next.tm_hour++;
+    else
+        next.tm_min++;
+
+    begin = mktime(&tm);
+    end = mktime(&next);
+    return begin != (time_t) -1 && end > begin;
+}
+
+static bool newer(const FileNode &f1, const FileNode &f2)
+{
+    return f1.mtime < f2.mtime;
+}
+
+/**
+ * 扫描时追加到子目录队列, 扫描结束后统一排序
+ * 有 scan-budget 时放入最大堆, 堆满后新的文件比堆顶(最新的文件)旧才替换堆顶
+ */
+void FileCtx::push(Subtree &subtree, FileNode &&node)
+{
+    // 硬链接, 指向普通文件的符号链接: 同一个文件只放入一次, 记录其他硬链接的路径
+    if (scan_budget == 0) {
+        auto slot = index->find(node.dev, node.ino);
+        if (slot) {
+            if (node.links)
+                add_link(*slot->node, node.path);
+            return;
+        }
+    }
+
+    dirtree->add(node.dir, node.alloc, node.mtime);
+    subtree.bytes += node.alloc;
+
+    if (scan_budget == 0) {
+        subtree.queue.push_back(std::move(node));
+        index->insert(&subtree, std::prev(subtree.queue.end()));
+        files++;
+        return;
+    }
+
+    // scan-budget 时没有按 inode 去重, 同一个文件的每个硬链接都是单独的节点. 按已分配的大小计算释放的空间,
+    // 否则 links < nlink 的节点永远不会因为空间不足被删除; 实际在最后一个链接删除后才释放
+    if (node.links)
+        node.links = node.nlink;
+
+    auto &window = subtree.window;
+    if (window.size() >= scan_budget) {
+        subtree.truncated = true;
+        if (node.mtime >= window.front().mtime)
+            return;
+        std::pop_heap(window.begin(), window.end(), newer);
+        window.pop_back();
+    }
+    window.push_back(std::move(node));
+    std::push_heap(window.begin(), window.end(), newer);
+}
+
+void FileCtx::add_link(FileNode &node, const string &path)
+{
+    node.links++;
+    links[make_pair(node.dev, node.ino)].push_back(path);
+}
+
+/**
+ * 文件删除后删除它的其他硬链接, 最后一个链接删除时才释放空间
+ */
+void FileCtx::remove_links(const FileNode &node)
+{
+    auto it = links.find(make_pair(node.dev, node.ino));
+    if (it == links.end())
+        return;
+
+    // 路径是扫描时记录的, 之后可能已经换成了另一个文件(如生产者轮转, rename), 只删除仍然是这个 inode 的链接
+    struct stat st;
+    for (auto &path: it->second) {
+        if (lstat(path.c_str(), &st) != 0 || st.st_dev != node.dev || st.st_ino != node.ino) {
+            spdlog::debug("delete link: {} ## not the same file any more, skipped ##", path);
+            continue;
+        }
+        if (unlink(path.c_str()) == 0)
+            spdlog::info("delete link: {}", path);
+        else
+            spdlog::warn("delete link: {} ## failed: {} ##", path, strerror(errno));
+    }
+    links.erase(it);
+}
+
+/**
+ * 文件的路径已经换成了另一个文件, 仍然指向它的其他硬链接代替它放入队列
+ */
+void FileCtx::relink(const FileNode &node)
+{
+    auto it = links.find(make_pair(node.dev, node.ino));
+    if (it == links.end())
+        return;
+
+    auto paths = std::move(it->second);
+    links.erase(it);
+    struct stat st;
+    for (auto &path: paths) {
+        if (lstat(path.c_str(), &st) != 0 || st.st_dev != node.dev || st.st_ino != node.ino)
+            continue;
+        auto slot = index->find(node.dev, node.ino);
+        if (slot)
+            add_link(*slot->node, path);
+        else
+            insert(make_node(path, st, nullptr));
+    }
+}
+
+/**
+ * path-time 的文件第一次需要大小时 stat, 修正统计
+ * @return false 文件已不存在, 已从队列中删除
+ */
+bool FileCtx::resolve(Subtree &subtree, list<FileNode>::iterator it)
+{
+    struct stat st;
+
+    if (lstat(it->path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        erase(subtree, it);
+        return false;
+    }
+
+    auto node = make_node(std::move(it->path), st, it->dir);
+    node.links = it->links;
+    dirtree->add(node.dir, node.alloc, node.mtime);
+    dirtree->remove(it->dir, it->alloc, it->mtime);
+    subtree.bytes += node.alloc - it->alloc;
+    subtree.version = ++generation;
+    unrank(subtree, it);
+    *it = std::move(node);
+    rank(subtree, it);
+    return true;
+}
+
+/**
+ * 取出子目录中最旧的文件放入 batch
+ */
+void FileCtx::pop(Subtree &subtree, list<FileNode> &batch)
+{
+    take(subtree, subtree.queue.begin(), batch);
+}
+
+/**
+ * 空间不足时下一个删除的文件: fifo 为队头, 否则为 priority 最小的文件
+ */
+list<FileNode>::iterator FileCtx::victim(Subtree &subtree)
+{
+    return policy && !subtree.ranked.empty() ? *subtree.ranked.begin() : subtree.queue.begin();
+}
+
+void FileCtx::rank(Subtree &subtree, list<FileNode>::iterator it)
+{
+    if (!policy)
+        return;
+    it->priority = policy->priority(*it);
+    subtree.ranked.insert(it);
+}
+
+void FileCtx::unrank(Subtree &subtree, list<FileNode>::iterator it)
+{
+    if (policy)
+        subtree.ranked.erase(it);
+}
+
+void FileCtx::touch(Subtree &subtree, list<FileNode>::iterator it, time_t when)
+{
+    unrank(subtree, it);
+    it->atime = std::max(it->atime, when);
+    it->hits++;
+    rank(subtree, it);
+}
+
+/**
+ * 删除前检查 st_atime, 上次看到之后被读取过的文件重新排序
+ * @return true 有新的访问
+ */
+bool FileCtx::accessed(Subtree &subtree, list<FileNode>::iterator it)
+{
+    struct stat st;
+
+    if (!policy || lstat(it->path.c_str(), &st) != 0 || st.st_atime <= it->atime)
+        return false;
+    touch(subtree, it, st.st_atime);
+    policy_stats.kept++;
+    return true;
+}
+
+bool FileCtx::access(dev_t dev, ino_t ino, time_t when)
+{
+    auto slot = index->find(dev, ino);
+    if (!policy || !slot)
+        return false;
+
+    touch(*slot->subtree, slot->node, when);
+    policy_stats.hits++;
+    return true;
+}
+
+/**
+ * 取出队列中任意位置的文件放入 batch
+ */
+void FileCtx::take(Subtree &subtree, list<FileNode>::iterator it, list<FileNode> &batch)
+{
+    unrank(subtree, it);
+    index->erase(it->dev, it->ino);
+    dirtree->remove(it->dir, it->alloc, it->mtime);
+    subtree.bytes -= it->alloc;
+    if (it != subtree.queue.begin())
+        subtree.version = ++generation;
+    batch.splice(batch.end(), subtree.queue, it);
+    files--;
+}
+
+void FileCtx::erase(Subtree &subtree, list<FileNode>::iterator it)
+{
+    unrank(subtree, it);
+    index->erase(it->dev, it->ino);
+    dirtree->remove(it->dir, it->alloc, it->mtime);
+    subtree.bytes -= it->alloc;
+    subtree.version = ++generation;
+    subtree.queue.erase(it);
+    files--;
+}
+
+/**
+ * 最旧的文件所在的子目录, 子目录数量很少, 直接遍历
+ */
+Subtree *FileCtx::oldest()
+{
+    Subtree *oldest = nullptr;
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        if (!subtree.queue.empty() && (!oldest || subtree.queue.front().mtime < oldest->queue.front().mtime))
+            oldest = &subtree;
+    }
+    return oldest;
+}
+
+/**
+ * 超出份额最多(bytes/weight 最大)的子目录
+ */
+Subtree *FileCtx::fullest()
+{
+    Subtree *fullest = nullptr;
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        if ((!subtree.queue.empty() || subtree.truncated) &&
+            (!fullest || subtree.bytes * fullest->weight > fullest->bytes * subtree.weight))
+            fullest = &subtree;
+    }
+    return fullest;
 }
 
 bool FileCtx::recursive_directory()
 {
-    try {
-        boost::filesystem::path p(directory);
-        boost::filesystem::recursive_directory_iterator end_iter;
-        for (boost::filesystem::recursive_directory_iterator iter(p); iter != end_iter; ++iter) {
-            parse_file(iter->path());
-            // 遍历过程中，remove文件会抛出异常?
+    TraceSpan span("scan", &directory);
+#ifdef HAVE_SDT
+    auto begin = Trace::now();
+#endif
+    vector<string> dirs;
+
+    TRACE_PROBE(scan__start, directory.c_str());
+    reset();
+    memset(&scan_errors, 0, sizeof(scan_errors));
+    dirs.push_back(directory);
+
+    // 上次扫描没有完成, 重放 journal 中已完成的目录, 从剩下的目录继续
+    if (checkpoint) {
+        using namespace std::placeholders;
+        auto fingerprint = scan_fingerprint();
+        if (!checkpoint->resume(directory, fingerprint, SCAN_CHECKPOINT_MAX_AGE,
+                                std::bind(&FileCtx::replay_directory, this, _1, _2, _3, std::ref(dirs)))) {
+            reset();
+            dirs.assign(1, directory);
+            checkpoint->start(directory, fingerprint);
+        }
+    }
+
+    while (!dirs.empty()) {
+        if (cancel && cancel()) {
+            if (checkpoint)
+                checkpoint->suspend();
+            spdlog::info("{}: scan interrupted, {} directories left", directory, dirs.size());
+            return false;
+        }
+
+        auto dir = std::move(dirs.back());
+        dirs.pop_back();
+        auto sub_dirs = dirs.size();
+        scan_directory(dir, dirs);
+
+        if (checkpoint) {
+            for (auto i = sub_dirs; i < dirs.size(); i++)
+                checkpoint->subdir(dirs[i].substr(dir.length() + 1));
+            checkpoint->commit(dir);
         }
-    } catch (boost::filesystem::filesystem_error &e) {
-        spdlog::error("recursive directory {} exception: {}", directory, e.what());
     }
 
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        for (auto &node: subtree.window) {
+            auto slot = index->find(node.dev, node.ino);
+            if (slot) {
+                if (node.links)
+                    add_link(*slot->node, node.path);
+                dirtree->remove(node.dir, node.alloc, node.mtime);
+                subtree.bytes -= node.alloc;
+                continue;
+            }
+            subtree.queue.push_back(std::move(node));
+            index->insert(&subtree, std::prev(subtree.queue.end()));
+            files++;
+        }
+        vector<FileNode>().swap(subtree.window);
+    }
+
+    if (checkpoint)
+        checkpoint->finish();
+    TRACE_PROBE(scan__end, directory.c_str(), files, Trace::now() - begin);
+    if (scan_errors.vanished || scan_errors.denied || scan_errors.other)
+        spdlog::info("{}: scan skipped {} vanished, {} permission denied, {} failed entries", directory,
+                     scan_errors.vanished, scan_errors.denied, scan_errors.other);
+
     remove_empty_directorys();
     sort();
     print_queue();
     return true;
 }
 
+/**
+ * 重放 journal 中的一个目录, 和 scan_directory 的结果相同
+ * @param dirs 扫描的目录栈, dir 必须在栈顶
+ */
+bool FileCtx::replay_directory(const string &dir, vector<FileNode> &nodes, vector<string> &subdirs,
+                               vector<string> &dirs)
+{
+    if (dirs.empty() || dirs.back() != dir)
+        return false;
+    dirs.pop_back();
+
+    if (!nodes.empty()) {
+        auto &subtree = subtree_of(dir);
+        auto dir_node = dirtree->node(dir);
+        for (auto &node: nodes) {
+            node.path = dir + "/" + node.path;
+            node.dir = dir_node;
+            push(subtree, std::move(node));
+        }
+    }
+    for (auto &name: subdirs)
+        dirs.push_back(dir + "/" + name);
+    return true;
+}
+
+/**
+ * 影响扫描结果的选项, 不同时 journal 不能使用
+ */
+string FileCtx::scan_fingerprint() const
+{
+    return "scan-budget=" + std::to_string(scan_budget) + " path-time=" + std::to_string(path_time) +
+           " share-depth=" + std::to_string(share_depth);
+}
+
+/**
+ * 目录或文件在扫描过程中被删除是正常的, 只记录 debug 日志
+ */
+void FileCtx::scan_error(const string &path, int err)
+{
+    if (err == ENOENT || err == ENOTDIR) {
+        scan_errors.vanished++;
+        spdlog::debug("{} vanished during scan", path);
+        return;
+    }
+
+    if (err == EACCES || err == EPERM)
+        scan_errors.denied++;
+    else
+        scan_errors.other++;
+    spdlog::warn("scan {} failed: {}", path, strerror(err));
+}
+
 //仅删除包含时间的目录 /var/log/bd_input_cache/smtp/log/2018/05/29/03/xxxxx/xxxx
 // 如 /var/log/bd_input_cache/smtp/log 则不删除
 static bool is_timer_dir(const boost::filesystem::path &path)
@@ -56,8 +722,14 @@ inline bool FileCtx::remove_empty_directory(const boost::filesystem::path &path)
 {
     boost::system::error_code ec;
     auto t = boost::filesystem::last_write_time(path);
-    auto r = boost::filesystem::remove(path, ec);
     auto time_str = boost::posix_time::to_simple_string(boost::posix_time::from_time_t(t));
+    if (reaper && reaper->stage(path.string())) {
+        d_dir += 1;
+        spdlog::info("stage empty dir: {} [{}]", path.string(), time_str);
+        return true;
+    }
+
+    auto r = boost::filesystem::remove(path, ec);
     if (!ec) {
         d_dir += 1;
         spdlog::info("delete empty dir: {} [{}]", path.string(), time_str);
@@ -95,47 +767,579 @@ void FileCtx::remove_empty_directorys()
     }
 }
 
-inline bool FileCtx::remove_file(const boost::filesystem::path &path)
+/**
+ * 删除文件
+ * @param node
+ * @param expire 非 0 时, 文件在扫描后被修改过并且没有超时则不删除, 重新放回队列
+ * @return
+ */
+bool FileCtx::remove_file(const FileNode &node, time_t expire)
 {
+    struct stat st;
     boost::system::error_code ec;
-    auto t = boost::filesystem::last_write_time(path);
-    auto file_size = boost::filesystem::file_size(path);
-    auto r = boost::filesystem::remove(path, ec);
-    auto time_str = boost::posix_time::to_simple_string(boost::posix_time::from_time_t(t));
+
+    if (lstat(node.path.c_str(), &st) != 0) {
+        spdlog::debug("{} no exists, ignore", node.path);
+        return false;
+    }
+
+    // 路径已经是另一个文件(如轮转, 或者删除的硬链接换成了新文件), 作为新文件放入队列
+    if (node.links > 0 && (st.st_dev != node.dev || st.st_ino != node.ino)) {
+        spdlog::debug("{} replaced after scan, keep it", node.path);
+        if (S_ISREG(st.st_mode))
+            insert(make_node(node.path, st, nullptr));
+        relink(node);
+        return false;
+    }
+
+    if (expire && st.st_mtime >= expire) {
+        spdlog::debug("{} modified after scan, keep it", node.path);
+        auto modified = make_node(node.path, st, nullptr);
+        modified.links = node.links;
+        insert(modified);
+        return false;
+    }
+
+    // 先删除其他硬链接, 回收站中的文件是最后一个链接, reaper 按释放的空间计数
+    remove_links(node);
+
+    auto time_str = boost::posix_time::to_simple_string(boost::posix_time::from_time_t(st.st_mtime));
+    if (reaper && reaper->stage(node.path)) {
+        d_file += 1;
+        spdlog::info("stage file: {} [{} {}]", node.path, st.st_size, time_str);
+        return true;
+    }
+
+    auto r = boost::filesystem::remove(node.path, ec);
     if (!ec) {
         d_file += 1;
-        spdlog::info("delete file: {} [{} {}]", path.string(), file_size, time_str);
+        spdlog::info("delete file: {} [{} {}]", node.path, st.st_size, time_str);
     } else {
-        spdlog::warn("delete file: {} [{} {}] ## failed: {} ##", path.string(), file_size, time_str, ec.message());
+        spdlog::warn("delete file: {} [{} {}] ## failed: {} ##", node.path, st.st_size, time_str, ec.message());
     }
 
     return r;
 }
 
-void FileCtx::parse_file(const boost::filesystem::path &path)
+/**
+ * 删除一批文件, locality 时按 目录+inode 的顺序 stat 和 unlink
+ */
+void FileCtx::remove_files(list<FileNode> &batch, time_t expire)
+{
+    TraceSpan span("unlink");
+    TRACE_PROBE(unlink__batch, batch.size(), expire);
+    if (locality) {
+        batch.sort([](const FileNode &f1, const FileNode &f2) {
+            auto l1 = f1.path.rfind('/');
+            auto l2 = f2.path.rfind('/');
+            int r = f1.path.compare(0, l1, f2.path, 0, l2);
+            return r < 0 || (r == 0 && f1.ino < f2.ino);
+        });
+    }
+
+    // 线程退出时(如 reload 停止这个目录)不等整批删除完, 剩下的文件下次扫描时再处理
+    size_t removed = 0;
+    for (auto &file: batch) {
+        if (cancel && cancel()) {
+            spdlog::info("{}: stopped, {} of {} files not deleted", directory, batch.size() - removed, batch.size());
+            break;
+        }
+        remove_file(file, expire);
+        removed++;
+    }
+    batch.clear();
+}
+
+/**
+ * 读取一个目录, 子目录放入 dirs, 普通文件放入队列
+ * 出错时只跳过该目录或文件并计数, 不影响其他目录的扫描
+ */
+void FileCtx::scan_directory(const string &dir, vector<string> &dirs)
 {
-    if (boost::filesystem::is_directory(path)) {
+    TraceSpan span("dir", &dir);
+    struct Entry {
+        string name;
+        ino_t ino;
+        unsigned char type;
+    };
+    vector<Entry> entries;
+    struct dirent *ent;
+    struct stat st;
+
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        scan_error(dir, errno);
+        return;
+    }
+
+    // rescan: 读取之前的时间戳, 读取过程中的修改下次 rescan 时能发现
+    struct stat dir_st;
+    bool record = rescan_enabled && scan_budget == 0 && fstat(dirfd(d), &dir_st) == 0;
+    vector<ino_t> inos;
+    vector<string> names;
+
+    errno = 0;
+    while ((ent = readdir(d)) != nullptr) {
+        if (skip_entry(ent->d_name))
+            continue;
+        entries.push_back(Entry{ent->d_name, ent->d_ino, ent->d_type});
+    }
+    // 读到一半出错, 已读到的项仍然处理
+    if (errno)
+        scan_error(dir, errno);
+    TRACE_PROBE(dir__read, dir.c_str(), entries.size());
+
+    int fd = dirfd(d);
+    if (entries.empty()) {
         // is_empty 表示 文件为空或者目录为空
-        if (boost::filesystem::is_empty(path) && is_timer_dir(path)) {
-            if (std::time(nullptr) - boost::filesystem::last_write_time(path) > 3600)
-                queue_empty_dir.push_back(path);
+        if (is_timer_dir(dir) && fstat(fd, &st) == 0 && std::time(nullptr) - st.st_mtime > 3600)
+            queue_empty_dir.push_back(dir);
+        closedir(d);
+        if (record)
+            remember(dir, dir_st, std::move(inos), std::move(names));
+        return;
+    }
+
+    // getdents 返回的是 hash 顺序, 按 inode 顺序 stat 可以减少机械硬盘的寻道
+    if (locality) {
+        std::sort(entries.begin(), entries.end(), [](const Entry &e1, const Entry &e2) {
+            return e1.ino < e2.ino;
+        });
+    }
+
+    // path-time: 日期目录中的普通文件不 stat, 跨过超时时间点的目录除外
+    time_t begin, end;
+    bool coarse = path_time && path_time_range(dir, directory.length(), begin, end);
+    if (coarse) {
+        auto cut = std::time(nullptr) - (time_t) timeout;
+        coarse = !(begin <= cut && cut < end) && fstat(fd, &st) == 0;
+    }
+    dev_t dev = coarse ? st.st_dev : 0;
+
+    auto &subtree = subtree_of(dir);
+    DirNode *dir_node = nullptr;
+    auto sub_dirs = dirs.size();
+    for (auto &e: entries) {
+        auto path = dir + "/" + e.name;
+        if (e.type == DT_DIR) {
+            if (record)
+                names.push_back(e.name);
+            dirs.push_back(std::move(path));
+            continue;
+        }
+
+        if (coarse && e.type == DT_REG) {
+            if (record)
+                inos.push_back(e.ino);
+            if (!dir_node)
+                dir_node = dirtree->node(dir);
+            FileNode node{std::move(path), end - 1, 0, 0, dev, e.ino, 1, 1, dir_node, true, end - 1, 0, 0};
+            if (checkpoint)
+                checkpoint->file(e.name, node);
+            push(subtree, std::move(node));
+            continue;
+        }
+
+        // 和 boost::filesystem::is_regular_file 一致, 指向普通文件的符号链接也放入队列
+        int flags = e.type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+        if (fstatat(fd, e.name.c_str(), &st, flags) != 0) {
+            // 指向不存在的文件的符号链接不是错误
+            if (e.type != DT_LNK || errno != ENOENT)
+                scan_error(path, errno);
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            if (!dir_node)
+                dir_node = dirtree->node(dir);
+            auto node = make_node(std::move(path), st, dir_node);
+            if (e.type == DT_LNK)
+                node.links = 0;
+            else if (record)
+                inos.push_back(st.st_ino);
+            if (checkpoint)
+                checkpoint->file(e.name, node);
+            push(subtree, std::move(node));
+        } else if (S_ISDIR(st.st_mode) && e.type == DT_UNKNOWN) {
+            if (record)
+                names.push_back(e.name);
+            dirs.push_back(std::move(path));
         }
-    } else if (boost::filesystem::is_regular_file(path)) {
-        queue.push_back(path);
     }
+    closedir(d);
+    if (record)
+        remember(dir, dir_st, std::move(inos), std::move(names));
+
+    // 出栈时仍然按 inode 升序访问子目录
+    std::reverse(dirs.begin() + sub_dirs, dirs.end());
 }
 
-void FileCtx::print_queue()
+/**
+ * rescan: 记录读取目录时的时间戳和内容
+ */
+void FileCtx::remember(const string &dir, const struct stat &st, vector<ino_t> &&files, vector<string> &&subdirs)
 {
-    spdlog::debug("{} queue size is {}", directory, queue.size());
-    return;
-    if (queue.empty()) {
-        spdlog::debug("{} queue is empty", directory);
+    auto &state = dir_states[dir];
+    state.mtime = st.st_mtim;
+    state.ctime = st.st_ctim;
+    // 同一秒内之后的修改可能不改变时间戳(秒级时间戳的文件系统), 下次一定重新读取
+    if (st.st_mtime >= std::time(nullptr) - 1)
+        state.mtime = timespec{0, 0};
+    std::sort(files.begin(), files.end());
+    std::sort(subdirs.begin(), subdirs.end());
+    state.files = std::move(files);
+    state.subdirs = std::move(subdirs);
+}
+
+/**
+ * 目录已不存在, 删除它和子目录的状态. 队列中的文件在删除时发现不存在
+ */
+void FileCtx::forget_directory(const string &dir)
+{
+    auto prefix = dir + "/";
+    dir_states.erase(dir);
+    auto it = dir_states.lower_bound(prefix);
+    while (it != dir_states.end() && !it->first.compare(0, prefix.length(), prefix))
+        it = dir_states.erase(it);
+}
+
+bool FileCtx::rescan()
+{
+    if (!rescan_enabled || scan_budget > 0 || dir_states.empty())
+        return false;
+
+    TraceSpan span("rescan", &directory);
+    boost::timer::cpu_timer cpu_timer;
+    memset(&rescan_stats, 0, sizeof(rescan_stats));
+    rescans++;
+    rescan_directory(directory, std::time(nullptr));
+    remove_empty_directorys();
+    cpu_timer.stop();
+    spdlog::info("{} rescan: {} dirs read, {} unchanged, {} pruned, {} subtrees skipped, {} new files, "
+                 "{} gone, use time: {}s", directory, rescan_stats.read, rescan_stats.unchanged,
+                 rescan_stats.pruned, rescan_stats.skipped, rescan_stats.added, rescan_stats.removed,
+                 cpu_timer.format(3, "%w"));
+    return true;
+}
+
+/**
+ * rescan 一个目录和它的子目录树
+ * @return 子目录树中时间戳变化的目录数
+ */
+unsigned long FileCtx::rescan_directory(const string &dir, time_t now)
+{
+    struct stat st;
+
+    if (cancel && cancel())
+        return 0;
+
+    auto &state = dir_states[dir];
+    if (rescans < state.due) {
+        rescan_stats.skipped++;
+        return 0;
+    }
+
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        forget_directory(dir);
+        return 1;
+    }
+
+    unsigned long changes = 0;
+    if (st.st_mtim.tv_sec != state.mtime.tv_sec || st.st_mtim.tv_nsec != state.mtime.tv_nsec ||
+        st.st_ctim.tv_sec != state.ctime.tv_sec || st.st_ctim.tv_nsec != state.ctime.tv_nsec) {
+        rescan_stats.read++;
+        rescan_entries(dir, state);
+        changes++;
     } else {
-        for (auto &p: queue) {
-            spdlog::debug("name: {}, time: {}", p.string(), boost::filesystem::last_write_time(p));
+        // 已经结束的日期目录(如过去的小时)不会再有新文件, 没有变化时不检查子目录
+        time_t begin, end;
+        if (path_time_range(dir, directory.length(), begin, end) && end + RESCAN_CLOSED_GRACE <= now) {
+            rescan_stats.pruned++;
+            return 0;
         }
+        rescan_stats.unchanged++;
+    }
+
+    // 子目录中的变化不改变本目录的时间戳, 仍然逐个检查
+    for (auto &name: state.subdirs)
+        changes += rescan_directory(dir + "/" + name, now);
+
+    // 连续没有变化的子目录树加倍访问间隔, 有变化后恢复每次访问
+    if (changes) {
+        state.quiet = 0;
+        state.due = rescans + 1;
+    } else {
+        state.quiet = std::min(state.quiet + 1, (unsigned int) RESCAN_MAX_BACKOFF);
+        state.due = rescans + (1UL << state.quiet);
     }
+    return changes;
+}
+
+/**
+ * 重新读取时间戳变化的目录: 队列中没有的文件放入队列, 不再存在的文件移出队列
+ */
+void FileCtx::rescan_entries(const string &dir, DirState &state)
+{
+    TraceSpan span("dir", &dir);
+    vector<ino_t> inos;
+    vector<string> names;
+    struct dirent *ent;
+    struct stat dir_st;
+    struct stat st;
+
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        scan_error(dir, errno);
+        return;
+    }
+    int fd = dirfd(d);
+    if (fstat(fd, &dir_st) != 0) {
+        scan_error(dir, errno);
+        closedir(d);
+        return;
+    }
+
+    while ((ent = readdir(d)) != nullptr) {
+        if (skip_entry(ent->d_name))
+            continue;
+        auto type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            names.push_back(ent->d_name);
+            continue;
+        }
+        // 符号链接指向的文件可能已在队列中, 留给下次完整扫描
+        if (type != DT_REG)
+            continue;
+
+        inos.push_back(ent->d_ino);
+        auto path = dir + "/" + ent->d_name;
+        auto slot = index->find(dir_st.st_dev, ent->d_ino);
+        if (slot && slot->node->path == path)
+            continue;
+        if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        // 已在队列中的文件的另一个硬链接; 只有一个链接时是改名, 按新的路径放入
+        if (slot && st.st_nlink > 1)
+            continue;
+        insert(make_node(std::move(path), st, nullptr));
+        rescan_stats.added++;
+    }
+    closedir(d);
+
+    if (inos.empty() && names.empty() && is_timer_dir(dir) && std::time(nullptr) - dir_st.st_mtime > 3600)
+        queue_empty_dir.push_back(dir);
+
+    auto old_files = std::move(state.files);
+    auto old_subdirs = std::move(state.subdirs);
+    remember(dir, dir_st, std::move(inos), std::move(names));
+
+    // 上次在目录中, 现在不在: 被其他进程删除或者移走
+    vector<ino_t> gone;
+    std::set_difference(old_files.begin(), old_files.end(), state.files.begin(), state.files.end(),
+                        std::back_inserter(gone));
+    for (auto ino: gone) {
+        auto slot = index->find(dir_st.st_dev, ino);
+        if (slot && slot->node->path.rfind('/') == dir.length() && !slot->node->path.compare(0, dir.length(), dir) &&
+            forget(dir_st.st_dev, ino))
+            rescan_stats.removed++;
+    }
+
+    vector<string> gone_dirs;
+    std::set_difference(old_subdirs.begin(), old_subdirs.end(), state.subdirs.begin(), state.subdirs.end(),
+                        std::back_inserter(gone_dirs));
+    for (auto &name: gone_dirs)
+        forget_directory(dir + "/" + name);
+}
+
+/**
+ * 按修改时间插入到队列中, 已在队列中的同一文件先移除
+ */
+void FileCtx::insert(const FileNode &node)
+{
+    nlink_t links = node.links;
+    unsigned int hits = node.hits;
+    time_t atime = node.atime;
+    auto slot = index->find(node.dev, node.ino);
+    if (slot) {
+        links = std::max(links, slot->node->links);
+        hits = std::max(hits, slot->node->hits);
+        atime = std::max(atime, slot->node->atime);
+        erase(*slot->subtree, slot->node);
+    }
+    if (scan_budget > 0 && links)
+        links = node.nlink;     // 和 push 相同, 没有按 inode 去重
+
+    auto dir = node.path.substr(0, node.path.rfind('/'));
+    auto &subtree = subtree_of(dir);
+    auto &queue = subtree.queue;
+    auto it = queue.end();
+
+    subtree.bytes += node.alloc;
+
+    // 截断的队列之外都是比队尾更新的文件, 保持这一点, 下次扫描时再放入队列
+    if (subtree.truncated && (queue.empty() || node.mtime > queue.back().mtime)) {
+        dirtree->add(dirtree->node(dir), node.alloc, node.mtime);
+        return;
+    }
+    files++;
+
+    // 较新的文件从队尾查找, 较旧的文件(如压缩后放回的文件)从队头查找
+    if (!queue.empty() && node.mtime - queue.front().mtime < queue.back().mtime - node.mtime) {
+        it = queue.begin();
+        while (it != queue.end() && it->mtime <= node.mtime)
+            ++it;
+    } else {
+        while (it != queue.begin() && std::prev(it)->mtime > node.mtime)
+            --it;
+    }
+
+    it = queue.insert(it, node);
+    subtree.version = ++generation;
+    it->links = links;
+    it->hits = hits;
+    it->atime = atime;
+    it->dir = dirtree->node(dir);
+    dirtree->add(it->dir, it->alloc, it->mtime);
+    index->insert(&subtree, it);
+    rank(subtree, it);
+}
+
+/**
+ * path 在 directory 下
+ */
+bool FileCtx::contains(const string &path) const
+{
+    return path.compare(0, directory.length(), directory) == 0 && path.length() > directory.length() &&
+           path[directory.length()] == '/';
+}
+
+/**
+ * 路径来自其他进程(如生产者的通知): 父目录解析后必须就是 directory 下的同一个目录,
+ * 即不经过符号链接, 没有 . 和 .., 文件本身(lstat)是普通文件
+ */
+bool FileCtx::verify(const string &path, struct stat &st)
+{
+    char real[PATH_MAX];
+
+    if (!contains(path))
+        return false;
+    if (real_directory.empty()) {
+        if (!realpath(directory.c_str(), real))
+            return false;
+        real_directory = real;
+    }
+
+    auto slash = path.rfind('/');
+    if (!realpath(path.substr(0, slash).c_str(), real) ||
+        real_directory.length() + slash - directory.length() != strlen(real) ||
+        real_directory.compare(0, string::npos, real, real_directory.length()) != 0 ||
+        path.compare(directory.length(), slash - directory.length(), real + real_directory.length()) != 0)
+        return false;
+
+    return lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool FileCtx::update(const string &path)
+{
+    struct stat st;
+
+    if (!verify(path, st))
+        return false;
+
+    insert(make_node(path, st, nullptr));
+    return true;
+}
+
+bool FileCtx::add(const FileNode &node)
+{
+    struct stat st;
+
+    // 只用通知中的 dev+inode 核对, 放入队列的信息来自 lstat
+    if (!verify(node.path, st) || st.st_dev != node.dev || st.st_ino != node.ino)
+        return false;
+
+    insert(make_node(node.path, st, nullptr));
+    return true;
+}
+
+bool FileCtx::forget(dev_t dev, ino_t ino)
+{
+    auto slot = index->find(dev, ino);
+    if (!slot)
+        return false;
+
+    links.erase(make_pair(dev, ino));
+    erase(*slot->subtree, slot->node);
+    return true;
+}
+
+void FileCtx::print_queue()
+{
+    spdlog::debug("{} queue size is {}, index {}/{}", directory, files, index->size(), index->capacity());
+    if (policy)
+        spdlog::debug("{} policy {}: {} accesses, {} files kept for a new atime", directory, policy->name(),
+                      policy_stats.hits, policy_stats.kept);
+    if (share_depth > 0 || scan_budget > 0) {
+        for (auto &it: subtrees) {
+            spdlog::debug("{} subtree {}: {} files {} bytes, weight {}{}", directory, it.first,
+                          it.second.queue.size(), it.second.bytes, it.second.weight,
+                          it.second.truncated ? ", truncated by scan-budget" : "");
+        }
+    }
+}
+
+void FileCtx::update_plan()
+{
+    TraceSpan span("plan", &directory);
+    auto old = plan();
+    auto &old_parts = old->subtrees();
+    vector<EvictionPlan::Part> parts;
+    bool changed = old_parts.size() != subtrees.size();
+    size_t i = 0;
+
+    // 子目录和旧的快照都按名字排序
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        while (i < old_parts.size() && old_parts[i].columns->name < it.first)
+            i++;
+        if (i < old_parts.size() && old_parts[i].columns->version == subtree.version &&
+            old_parts[i].columns->age.size() >= subtree.queue.size()) {
+            auto head = old_parts[i].columns->age.size() - subtree.queue.size();
+            changed = changed || head != old_parts[i].head;
+            parts.push_back(EvictionPlan::Part{old_parts[i].columns, head});
+            continue;
+        }
+        parts.push_back(EvictionPlan::Part{EvictionPlan::build(it.first, subtree.version, subtree.queue), 0});
+        changed = true;
+    }
+    if (!changed)
+        return;
+
+    auto snapshot = make_shared<const EvictionPlan>(std::move(parts));
+    MutexLock(&plan_mutex);
+    plan_snapshot = snapshot;
+    MutexUnlock(&plan_mutex);
+}
+
+void FileCtx::drop_plan()
+{
+    auto snapshot = make_shared<const EvictionPlan>(vector<EvictionPlan::Part>());
+    MutexLock(&plan_mutex);
+    plan_snapshot = snapshot;
+    MutexUnlock(&plan_mutex);
+}
+
+shared_ptr<const EvictionPlan> FileCtx::plan()
+{
+    MutexLock(&plan_mutex);
+    auto snapshot = plan_snapshot;
+    MutexUnlock(&plan_mutex);
+    return snapshot;
 }
 
 /**
@@ -143,24 +1347,299 @@ void FileCtx::print_queue()
  */
 void FileCtx::sort()
 {
-    queue.sort([](boost::filesystem::path &p1, boost::filesystem::path &p2) {
-        return boost::filesystem::last_write_time(p1) < boost::filesystem::last_write_time(p2);
-    });
+    TraceSpan span("sort", &directory);
+    for (auto &it: subtrees) {
+        auto &subtree = it.second;
+        subtree.version = ++generation;
+        subtree.queue.sort([](const FileNode &f1, const FileNode &f2) {
+            return f1.mtime < f2.mtime;
+        });
+        subtree.ranked.clear();
+        for (auto node = subtree.queue.begin(); node != subtree.queue.end(); ++node)
+            rank(subtree, node);
+    }
 }
 
 /**
  * 该目录到达设置的阈值，开始删除文件
+ * 配置了 shares 时, 每次从超出份额最多的子目录中删除最旧的文件 (policy 不是 fifo 时为 priority 最小的文件)
+ * 截断的队列用完时先删除已选出的文件, 再重新扫描下一批
  * @param bytes
  */
 void FileCtx::delete_for_limit(off_t bytes)
 {
+    TraceSpan span("evict", &directory);
+    off_t delete_bytes = 0;
+    off_t rescan_bytes = -1;
+    list<FileNode> batch;
+    list<FileNode> held;
+    Subtree *subtree;
+    if (unlink_window > 0 && !policy && share_depth == 0)
+        delete_bytes = select_fewest(bytes, batch);
+    while (delete_bytes < bytes && !(cancel && cancel())) {
+        subtree = share_depth > 0 ? fullest() : oldest();
+        if (subtree && !subtree->queue.empty()) {
+            auto it = victim(*subtree);
+            // 按 policy 排序时, stat 后的大小和访问时间可能改变顺序, 重新选择
+            if (it->coarse) {
+                if (!resolve(*subtree, it) || policy)
+                    continue;
+            } else if (accessed(*subtree, it)) {
+                continue;
+            }
+
+            // 还有其他硬链接的文件删除后不释放空间, 留给超时删除; 打开的文件关闭后才释放
+            if ((it->alloc > 0 && it->gain() == 0) || is_open(*it)) {
+                take(*subtree, it, held);
+                continue;
+            }
+            delete_bytes += it->gain();
+            if (policy)
+                policy->evicted(*it);
+            take(*subtree, it, batch);
+            continue;
+        }
+
+        // 上一次重新扫描后没有进展(如无法删除的空文件)时停止
+        if (scan_budget == 0 || !exhausted() || delete_bytes == rescan_bytes)
+            break;
+        rescan_bytes = delete_bytes;
+        TRACE_PROBE(evict__plan, bytes, delete_bytes);
+        remove_files(batch);
+        held.clear();
+        recursive_directory();
+    }
+    TRACE_PROBE(evict__plan, bytes, delete_bytes);
+    remove_files(batch);
+    for (auto &node: held)
+        insert(node);
+}
+
+/**
+ * unlink-window: 每个文件的代价都是一次 unlink, 按释放的空间从大到小选择, 得到的文件数最少.
+ * 最后一个文件换成仍然足够的最小的文件, 少删除数据; 大小相同时先选较旧的文件.
+ * 跳过的文件(其他硬链接, 打开的文件)和窗口之后的文件留给按时间顺序删除
+ * @return 放入 batch 的文件释放的字节数, 窗口内不够时为 0
+ */
+off_t FileCtx::select_fewest(off_t bytes, list<FileNode> &batch)
+{
+    if (subtrees.empty())
+        return 0;
+
+    auto &subtree = subtrees.begin()->second;
+    auto &queue = subtree.queue;
+    if (queue.empty())
+        return 0;
+
+    // 窗口: 队列时间跨度中最旧的 unlink_window%, 至少包括按时间顺序删除的文件, 选出的文件数不会更多
+    auto horizon = queue.front().mtime + (queue.back().mtime - queue.front().mtime) * (time_t) unlink_window / 100;
+    vector<list<FileNode>::iterator> candidates;
+    unsigned long fifo = 0;
+    off_t fifo_bytes = 0;
+
+    for (auto it = queue.begin(); it != queue.end() && !it->coarse; ++it) {
+        if (it->mtime > horizon && fifo_bytes >= bytes)
+            break;
+        if ((it->alloc > 0 && it->gain() == 0) || is_open(*it))
+            continue;
+        candidates.push_back(it);
+        if (fifo_bytes < bytes) {
+            fifo_bytes += it->gain();
+            fifo++;
+        }
+    }
+    if (fifo_bytes < bytes)
+        return 0;
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const list<FileNode>::iterator &a, const list<FileNode>::iterator &b) {
+                         return a->gain() > b->gain();
+                     });
+    size_t count = 0;
+    off_t selected = 0;
+    while (selected < bytes)
+        selected += candidates[count++]->gain();
+
+    // 最后一个: 换成仍然足够的最小的文件. 从大到小排列, 足够的文件在前面; 大小相同时按队列顺序, 取最旧的
+    off_t need = bytes - (selected - candidates[count - 1]->gain());
+    auto last = std::partition_point(candidates.begin() + count, candidates.end(),
+                                     [need](const list<FileNode>::iterator &it) { return it->gain() >= need; });
+    off_t gain = (*std::prev(last))->gain();
+    auto pick = std::partition_point(candidates.begin() + count - 1, last,
+                                     [gain](const list<FileNode>::iterator &it) { return it->gain() > gain; });
+    selected += gain - candidates[count - 1]->gain();
+    std::iter_swap(candidates.begin() + count - 1, pick);
+
+    for (size_t i = 0; i < count; i++)
+        take(subtree, candidates[i], batch);
+
+    unlink_stats.runs++;
+    unlink_stats.unlinks += count;
+    unlink_stats.saved += fifo - count;
+    spdlog::info("{} unlink-window: {} files {} bytes for {} bytes from {} candidates, oldest first needs {} files, "
+                 "saved {} unlinks ({} in {} runs)", directory, count, selected, bytes, candidates.size(), fifo,
+                 fifo - count, unlink_stats.saved, unlink_stats.runs);
+    return selected;
+}
+
+void FileCtx::delete_for_inodes(unsigned long count)
+{
+    TraceSpan span("evict", &directory);
+    struct Candidate {
+        Subtree *subtree;
+        list<FileNode>::iterator it;
+    };
+    struct Group {
+        unsigned long files;
+        off_t bytes;
+        vector<size_t> members;     // candidates, 从旧到新
+    };
+    vector<Candidate> candidates;
+    size_t window = count * INODE_WINDOW_FACTOR;
+
+    // 所有子目录中最旧的 window 个文件
+    for (auto &it: subtrees) {
+        auto &queue = it.second.queue;
+        size_t n = 0;
+        for (auto node = queue.begin(); node != queue.end() && n < window; ++node, ++n)
+            candidates.push_back(Candidate{&it.second, node});
+    }
+    auto older = [](const Candidate &c1, const Candidate &c2) {
+        return c1.it->mtime < c2.it->mtime;
+    };
+    if (candidates.size() > window) {
+        std::partial_sort(candidates.begin(), candidates.begin() + window, candidates.end(), older);
+        candidates.resize(window);
+    } else {
+        std::sort(candidates.begin(), candidates.end(), older);
+    }
+
+    // 按目录分组, 平均大小最小的目录优先, 平均大小相同时文件多的目录优先
+    map<DirNode *, Group> groups;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        auto &node = *candidates[i].it;
+        auto &group = groups[node.dir];
+        group.files++;
+        group.bytes += node.alloc;
+        group.members.push_back(i);
+    }
+    vector<Group *> order;
+    for (auto &it: groups)
+        order.push_back(&it.second);
+    std::sort(order.begin(), order.end(), [](const Group *g1, const Group *g2) {
+        auto a1 = g1->bytes * (off_t) g2->files;
+        auto a2 = g2->bytes * (off_t) g1->files;
+        return a1 < a2 || (a1 == a2 && g1->files > g2->files);
+    });
+
+    // 还有其他硬链接的文件删除后不释放 inode, 打开的文件关闭后才释放
+    list<FileNode> batch;
+    unsigned long dirs = 0;
+    off_t bytes = 0;
+    for (auto group: order) {
+        if (batch.size() >= count)
+            break;
+        auto taken = batch.size();
+        for (auto i: group->members) {
+            auto &c = candidates[i];
+            if (batch.size() >= count)
+                break;
+            if (c.it->links < c.it->nlink || is_open(*c.it))
+                continue;
+            bytes += c.it->alloc;
+            take(*c.subtree, c.it, batch);
+        }
+        dirs += batch.size() > taken;
+    }
+
+    spdlog::info("{} inode eviction: {} files {} bytes from {} dirs for {} inodes", directory, batch.size(), bytes,
+                 dirs, count);
+    TRACE_PROBE(evict__plan, bytes, batch.size());
+    remove_files(batch);
+}
+
+/**
+ * 紧急删除时待展开的目录, key 为路径中以数字开头的目录名(日期目录, 如 2018/05/29/03)
+ * 非日期目录(如 smtp, http)不改变 key, 先于其下的日期目录展开. 它们(和根目录)中的文件没有日期,
+ * 不知道新旧, 不删除
+ */
+struct EmergencyDir {
+    vector<string> key;
+    string path;
+};
+
+off_t FileCtx::delete_for_emergency(off_t bytes)
+{
+    TraceSpan span("emergency", &directory);
+    boost::timer::cpu_timer cpu_timer;
     off_t delete_bytes = 0;
-    while (delete_bytes < bytes && !queue.empty()) {
-        auto &file = queue.front();
-        delete_bytes += boost::filesystem::file_size(file);
-        remove_file(file);
-        queue.pop_front();
+    unsigned long dirs = 0;
+    unsigned long deleted = 0;
+    struct dirent *ent;
+    struct stat st;
+
+    // key 最小的目录在堆顶, 只展开它, 同一层其他的日期目录保持未读取
+    auto later = [](const EmergencyDir &d1, const EmergencyDir &d2) {
+        return d1.key > d2.key;
+    };
+    vector<EmergencyDir> frontier;
+    frontier.push_back(EmergencyDir{vector<string>(), directory});
+
+    while (delete_bytes < bytes && !frontier.empty() && !(cancel && cancel())) {
+        std::pop_heap(frontier.begin(), frontier.end(), later);
+        auto dir = std::move(frontier.back());
+        frontier.pop_back();
+
+        DIR *d = opendir(dir.path.c_str());
+        if (d == nullptr)
+            continue;
+        dirs++;
+
+        vector<FileNode> victims;
+        int fd = dirfd(d);
+        while ((ent = readdir(d)) != nullptr) {
+            if (skip_entry(ent->d_name))
+                continue;
+
+            // 只删除释放空间的文件: 不跟随符号链接, 跳过有其他硬链接的文件
+            bool is_dir = ent->d_type == DT_DIR;
+            if (!is_dir) {
+                if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                is_dir = ent->d_type == DT_UNKNOWN && S_ISDIR(st.st_mode);
+            }
+
+            auto path = dir.path + "/" + ent->d_name;
+            if (is_dir) {
+                EmergencyDir child{dir.key, std::move(path)};
+                if (isdigit((unsigned char) ent->d_name[0]))
+                    child.key.push_back(ent->d_name);
+                frontier.push_back(std::move(child));
+                std::push_heap(frontier.begin(), frontier.end(), later);
+            } else if (!dir.key.empty() && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+                victims.push_back(make_node(std::move(path), st, nullptr));
+            }
+        }
+        closedir(d);
+
+        std::sort(victims.begin(), victims.end(), newer);
+        for (auto &node: victims) {
+            if (delete_bytes >= bytes || (cancel && cancel()))
+                break;
+            // 打开的文件关闭后才释放空间, 和 delete_for_limit 相同
+            if (is_open(node))
+                continue;
+            if (remove_file(node)) {
+                delete_bytes += node.gain();
+                deleted++;
+            }
+        }
     }
+
+    cpu_timer.stop();
+    spdlog::warn("{} emergency delete: {} files {} bytes of {} bytes, read {} dirs, use time: {}s",
+                 directory, deleted, delete_bytes, bytes, dirs, cpu_timer.format(3, "%w"));
+    return delete_bytes;
 }
 
 /**
@@ -168,24 +1647,28 @@ void FileCtx::delete_for_limit(off_t bytes)
  */
 void FileCtx::delele_for_timeout()
 {
+    TraceSpan span("timeout", &directory);
     std::time_t next_file_time = 0;
     boost::timer::cpu_timer cpu_timer;
     auto current_time = std::time(nullptr);
-    while (!queue.empty()) {
-        auto &file = queue.front();
-        if (!boost::filesystem::exists(file)) {
-            spdlog::debug("{} no exists, ignore", file.c_str());
-            queue.pop_front();
-            continue;
-        }
-        if (current_time - boost::filesystem::last_write_time(file) > timeout) {
-            remove_file(file);
-            queue.pop_front();
+    list<FileNode> batch;
+    list<FileNode> held;
+    Subtree *subtree;
+    while ((subtree = oldest()) != nullptr && !(cancel && cancel())) {
+        auto &file = subtree->queue.front();
+        if (current_time - file.mtime > timeout) {
+            // 仍在写入的文件(如长时间没有刷新 mtime)不删除
+            pop(*subtree, is_open(file) ? held : batch);
         } else {
-            next_file_time = boost::filesystem::last_write_time(file);
+            next_file_time = file.mtime;
             break;
         }
     }
+    remove_files(batch, current_time - timeout);
+    for (auto &node: held)
+        insert(node);
+    if (!held.empty())
+        spdlog::info("{} expired but still open: {} files", directory, held.size());
     cpu_timer.stop();
     if (next_file_time != 0)
         spdlog::info("next timeout after {}s, use time: {}s",
@@ -193,3 +1676,55 @@ void FileCtx::delele_for_timeout()
     else
         spdlog::info("use time: {}s", cpu_timer.format(3, "%w"));
 }
+
+unsigned int FileCtx::compress_collect(Compressor *compressor)
+{
+    struct stat st;
+    list<Compressor::Job> jobs;
+
+    compressor->done(jobs);
+    for (auto &job: jobs) {
+        auto &path = job.ok ? job.target : job.path;
+        if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            insert(make_node(path, st, nullptr));
+    }
+    return jobs.size();
+}
+
+unsigned int FileCtx::compress_for_age(Compressor *compressor, unsigned long age)
+{
+    auto done = compress_collect(compressor);
+    auto expire = std::time(nullptr) - (time_t) age;
+    static const size_t suffix_len = strlen(COMPRESS_SUFFIX);
+    static const size_t tmp_suffix_len = strlen(COMPRESS_TMP_SUFFIX);
+
+    for (auto &sub: subtrees) {
+        auto &queue = sub.second.queue;
+        for (auto it = queue.begin(); it != queue.end() && it->mtime < expire;) {
+            auto &path = it->path;
+            // 压缩写入新文件, 有其他链接(或是符号链接)的文件压缩后不释放空间
+            // .zst.tmp: 正在写入或者崩溃后留下的, 只按超时和空间删除
+            if ((path.length() > suffix_len &&
+                 !path.compare(path.length() - suffix_len, suffix_len, COMPRESS_SUFFIX)) ||
+                (path.length() > tmp_suffix_len &&
+                 !path.compare(path.length() - tmp_suffix_len, tmp_suffix_len, COMPRESS_TMP_SUFFIX)) ||
+                it->links < it->nlink || is_open(*it)) {
+                ++it;
+                continue;
+            }
+            if (it->coarse) {
+                auto next = std::next(it);
+                if (!resolve(sub.second, it)) {
+                    it = next;
+                    continue;
+                }
+            }
+            if (!compressor->submit(path, it->mtime, it->size))
+                return done;
+            auto next = std::next(it);
+            erase(sub.second, it);
+            it = next;
+        }
+    }
+    return done;
+}
\ No newline at end of file
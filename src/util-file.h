@@ -7,33 +7,374 @@
 #include <cstdint>
 #include <sys/param.h>
 #include <cstring>
+#include <ctime>
+#include <functional>
 #include <string>
 #include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
 #include <json/json.h>
 #include <boost/filesystem.hpp>
+#include "reaper.h"
+#include "openfiles.h"
+#include "compress.h"
+#include "util-dirtree.h"
 
 using namespace std;
 
+class FileIndex;
+
+class ScanCheckpoint;
+
+class EvictionPlan;
+
+class EvictionPolicy;
+
+/**
+ * 队列中的文件, 扫描时 stat 一次并缓存, 排序和删除时不再重复 stat
+ */
+struct FileNode {
+    string path;
+    time_t mtime;
+    off_t size;
+    off_t alloc;            // st_blocks * 512, 稀疏文件小于 size
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink;
+    nlink_t links;          // 扫描到的硬链接数(path 为符号链接时不计), 等于 nlink 时删除才释放空间
+    DirNode *dir;
+    bool coarse;            // path-time: mtime 来自目录名, 大小未知, 需要时再 stat
+    time_t atime;           // 最后一次访问, 扫描时来自 st_atime, 之后由 access 更新
+    unsigned int hits;      // 观察到的访问次数
+    double priority;        // policy 的排序键, 在 Subtree::ranked 中时不能修改
+
+    /**
+     * \brief 删除后释放的空间, 还有其他硬链接时为 0
+     */
+    off_t gain() const
+    {
+        return links >= nlink ? alloc : 0;
+    }
+};
+
+/**
+ * policy 的排序: priority 小的在前, 相同时较旧的文件在前
+ */
+struct RankLess {
+    bool operator()(const list<FileNode>::iterator &a, const list<FileNode>::iterator &b) const
+    {
+        if (a->priority != b->priority)
+            return a->priority < b->priority;
+        if (a->mtime != b->mtime)
+            return a->mtime < b->mtime;
+        return &*a < &*b;
+    }
+};
+
+/**
+ * 一个子目录(如 bd_input_cache 下的 smtp, http)中的文件, 按修改时间排序
+ * 未配置 shares 时只有一个子目录 "", 即整个目录
+ */
+struct Subtree {
+    string name;
+    unsigned int weight;
+    off_t bytes;            // 占用的空间, 增量维护, 不重新统计. 包括 scan-budget 截断时不在队列中的文件
+    list<FileNode> queue;
+
+    // scan-budget: 扫描时只保留最旧的文件, 按 mtime 的最大堆, 扫描结束后转入 queue
+    vector<FileNode> window;
+    bool truncated;         // 有更新的文件没有放入队列, 队列用完时需要重新扫描
+
+    unsigned long version;  // 除了从队头取出文件, 队列每次修改后更新, 用于判断 plan 的列是否需要重建
+
+    set<list<FileNode>::iterator, RankLess> ranked;    // policy 不是 fifo 时, queue 中的所有文件按 priority 排序
+};
+
+/**
+ * rescan: 上次读取目录时的状态. 增删文件会改变目录的 mtime, 时间戳不变的目录不重新读取
+ */
+struct DirState {
+    struct timespec mtime;      // 读取时修改时间还在当前这一秒内时为 0, 下次一定重新读取
+    struct timespec ctime;
+    vector<ino_t> files;        // 普通文件的 inode, 升序, 用于找出消失的文件
+    vector<string> subdirs;
+    unsigned int quiet;         // 连续几次 rescan 整个子目录树没有变化
+    unsigned long due;          // 下次访问的 rescan 序号, 之前跳过整个子目录树
+};
+
 // 1TB 空间 大约有500万个文件
 class FileCtx {
 public:
-    FileCtx(const std::string &directory, unsigned int limit, unsigned int safe, unsigned long timeout, bool emptydir);
+    FileCtx(const std::string &directory, unsigned int limit, unsigned int safe, unsigned long timeout, bool emptydir,
+            size_t hash_size = 0);
+
+    /**
+     * \brief locality: 扫描时按 inode 顺序 stat, 删除时每批文件按 目录+inode 顺序 unlink,
+     *        只改变操作顺序, 不改变删除哪些文件 (机械硬盘减少寻道)
+     */
+    void set_locality(bool locality)
+    {
+        this->locality = locality;
+    }
 
-    ~FileCtx() = default;
+    ~FileCtx();
 
     bool empty() const noexcept
     {
-        return queue.empty();
+        return files == 0;
+    }
+
+    /**
+     * \brief scan-budget: 每个子目录扫描时只在内存中保留最旧的 budget 个文件,
+     *        其余文件只计入目录统计, 子目录的队列用完后重新扫描下一批
+     * @param budget 0 表示不限制
+     */
+    void set_scan_budget(size_t budget);
+
+    /**
+     * \brief path-time: 至少精确到天的日期目录(如 2018/05/29/03)中的文件不 stat,
+     *        修改时间取目录时间范围的结束时间, 大小在删除或压缩前再 stat.
+     *        时间范围跨过超时时间点的目录仍然逐个 stat
+     */
+    void set_path_time(bool path_time);
+
+    /**
+     * \brief scan-checkpoint: 扫描过程写入 journal, 扫描中途停止(退出或崩溃)后, 下次启动时从停止的位置继续扫描
+     * @param path journal 文件, "" 表示不使用
+     */
+    void set_checkpoint(const string &path);
+
+    /**
+     * \brief 扫描时在每个目录之前检查, 返回 true 时停止扫描 (如线程退出)
+     */
+    void set_cancel(std::function<bool()> cancel)
+    {
+        this->cancel = std::move(cancel);
+    }
+
+    /**
+     * \brief rescan: 完整扫描时记录每个目录的 mtime/ctime, 之后可以用 rescan() 增量扫描.
+     *        scan-budget 的截断队列不能增量更新, 此时不记录
+     */
+    void set_rescan(bool rescan);
+
+    /**
+     * \brief policy: 空间不足时子目录中先删除哪个文件
+     *        fifo 按修改时间; lru 按最后访问时间; gdsf 按 GreedyDual-Size-Frequency, 访问多的小文件保留最久.
+     *        访问来自 st_atime (删除前再 stat 一次, 有新的访问则重新排序, noatime 的挂载点没有访问),
+     *        以及 access() (如 fanotify). 每次更新 O(log n). 超时删除, 压缩和 plan 仍然按修改时间
+     * \retval false 未知的 policy, 使用 fifo
+     */
+    bool set_policy(const string &name);
+
+    /**
+     * \brief unlink-window: 空间不足时在队列时间跨度中最旧的 percent% 的文件(至少包括按时间顺序需要删除的文件)中,
+     *        选出释放足够空间而文件数最少的集合, 即允许删除稍新的大文件来代替大量旧的小文件.
+     *        只用于 policy fifo 并且没有 shares, path-time 的文件(大小未知)结束窗口
+     * @param percent 0 表示严格按时间顺序
+     */
+    void set_unlink_window(unsigned int percent)
+    {
+        unlink_window = percent;
+    }
+
+    /**
+     * \brief 文件被读取, 按 policy 重新排序
+     * \retval false 不在队列中或者 policy 为 fifo
+     */
+    bool access(dev_t dev, ino_t ino, time_t when);
+
+    /**
+     * \brief 需要重新扫描: 队列为空, 或者有被截断的子目录的队列已经用完
+     */
+    bool exhausted() const;
+
+    /**
+     * \brief 按 path 下前 depth 级目录划分子目录, 空间不足时优先删除 bytes/weight 最大的子目录中最旧的文件
+     * @param shares 子目录的权重, 如 {"smtp": 2, "*": 1}, 未配置的子目录使用 "*" 的权重(默认 1)
+     * @param depth 0 表示不划分, 全局按时间删除
+     */
+    void set_shares(const Json::Value &shares, unsigned int depth);
+
+    /**
+     * \brief 更新阈值与超时时间, 已扫描的队列保持不变
+     */
+    void reconfigure(unsigned int limit, unsigned int safe, unsigned long timeout, bool emptydir);
+
+    /**
+     * \brief 设置后, 删除的文件和目录先移动到回收站, 由 reaper 线程在后台释放
+     */
+    void set_reaper(Reaper *reaper)
+    {
+        this->reaper = reaper;
+    }
+
+    /**
+     * \brief 设置后, 被进程打开的文件不删除也不压缩, 关闭后再处理
+     */
+    void set_open_files(OpenFiles *open_files)
+    {
+        this->open_files = open_files;
+    }
+
+    const string &path() const noexcept
+    {
+        return directory;
+    }
+
+    /**
+     * \brief du: 目录的大小, 文件数, 最旧和最新的文件时间
+     */
+    bool du(const string &prefix, unsigned int depth, Json::Value &result)
+    {
+        return dirtree->query(prefix, depth, result);
     }
 
+    /**
+     * \brief 完整扫描, 读取目录或文件出错时只跳过出错的目录或文件并计数
+     * \retval false 被 cancel 中断, 队列不完整
+     */
     bool recursive_directory();
 
+    /**
+     * \brief 增量扫描: 只重新读取时间戳变化的目录, 新文件放入队列, 消失的文件移出队列.
+     *        没有变化并且时间范围已结束的日期目录(如过去的小时)整个跳过;
+     *        连续没有变化的子目录树每次加倍访问间隔, 最多每 8 次 rescan 访问一次, 有变化后恢复每次访问.
+     *        目录中已有文件的内容修改(目录时间戳不变)不会被发现, 符号链接留给下次完整扫描
+     * \retval false 没有目录状态(未启用 rescan 或者还没有完整扫描), 需要完整扫描
+     */
+    bool rescan();
+
+    /**
+     * \brief 按队列重建 plan 的列快照, 只有队头被取出的子目录不重建. 有 plan 查询时每次 loop 后调用
+     */
+    void update_plan();
+
+    /**
+     * \brief 不再查询时释放快照, 之后的 update_plan 全部重建
+     */
+    void drop_plan();
+
+    /**
+     * \brief 最近一次 update_plan 的快照, 可以在其他线程中查询
+     */
+    shared_ptr<const EvictionPlan> plan();
+
+    /**
+     * \brief 文件新建, 修改或者改名后调用, 已在队列中的文件(按 dev+inode 查找)按新的路径和修改时间重新放入.
+     *        父目录不能经过符号链接, 符号链接本身不放入
+     * \retval false 文件不存在, 不是普通文件或者不在 path 下
+     */
+    bool update(const string &path);
+
+    /**
+     * \brief 和 update 相同, 用于调用者给出的文件(如生产者的通知): dev+inode 和 lstat 的结果不同时不放入队列
+     * \retval false 不在 path 下, 经过符号链接, 不是普通文件或者 dev+inode 不一致
+     */
+    bool add(const FileNode &node);
+
+    /**
+     * \brief 文件已被删除, 从队列中移除
+     * \retval false 不在队列中
+     */
+    bool forget(dev_t dev, ino_t ino);
+
     void delete_for_limit(off_t bytes);
 
+    /**
+     * \brief inode 不足时按文件数删除: 在最旧的 2*count 个文件中, 优先删除平均大小最小的目录中的文件,
+     *        每次 unlink 同样释放一个 inode, 保留更多的数据. 不按 shares 的份额
+     * @param count 需要释放的 inode 数
+     */
+    void delete_for_inodes(unsigned long count);
+
+    /**
+     * \brief 启动后第一次完整扫描之前磁盘已满时使用(emergency), 不等待完整扫描: 按日期目录名的顺序只展开最旧的分支, 边读边删除.
+     *        只删除至少在一层日期目录下的文件
+     * @return 删除的字节数
+     */
+    off_t delete_for_emergency(off_t bytes);
+
     void delele_for_timeout();
 
+    /**
+     * \brief action: compress, 超过 age 的文件交给 compressor 压缩, 压缩中的文件不在队列中
+     * @return 本次完成的压缩任务数
+     */
+    unsigned int compress_for_age(Compressor *compressor, unsigned long age);
+
+    /**
+     * \brief 取回 compressor 完成的任务, 压缩文件(或失败时的原文件)放回队列
+     */
+    unsigned int compress_collect(Compressor *compressor);
+
 private:
-    void parse_file(const boost::filesystem::path &path);
+    bool contains(const string &path) const;
+
+    bool verify(const string &path, struct stat &st);
+
+    void scan_directory(const string &dir, vector<string> &dirs);
+
+    bool replay_directory(const string &dir, vector<FileNode> &nodes, vector<string> &subdirs, vector<string> &dirs);
+
+    string scan_fingerprint() const;
+
+    void scan_error(const string &path, int err);
+
+    void remember(const string &dir, const struct stat &st, vector<ino_t> &&files, vector<string> &&subdirs);
+
+    unsigned long rescan_directory(const string &dir, time_t now);
+
+    void rescan_entries(const string &dir, DirState &state);
+
+    void forget_directory(const string &dir);
+
+    void reset();
+
+    Subtree &subtree_of(const string &dir);
+
+    unsigned int share_weight(const string &name) const;
+
+    void insert(const FileNode &node);
+
+    void push(Subtree &subtree, FileNode &&node);
+
+    void add_link(FileNode &node, const string &path);
+
+    void remove_links(const FileNode &node);
+
+    void relink(const FileNode &node);
+
+    bool resolve(Subtree &subtree, list<FileNode>::iterator it);
+
+    bool is_open(const FileNode &node)
+    {
+        return open_files && open_files->isOpen(node.dev, node.ino);
+    }
+
+    void pop(Subtree &subtree, list<FileNode> &batch);
+
+    list<FileNode>::iterator victim(Subtree &subtree);
+
+    off_t select_fewest(off_t bytes, list<FileNode> &batch);
+
+    void rank(Subtree &subtree, list<FileNode>::iterator it);
+
+    void unrank(Subtree &subtree, list<FileNode>::iterator it);
+
+    void touch(Subtree &subtree, list<FileNode>::iterator it, time_t when);
+
+    bool accessed(Subtree &subtree, list<FileNode>::iterator it);
+
+    void take(Subtree &subtree, list<FileNode>::iterator it, list<FileNode> &batch);
+
+    void erase(Subtree &subtree, list<FileNode>::iterator it);
+
+    Subtree *oldest();
+
+    Subtree *fullest();
 
     inline bool remove_empty_directory(const boost::filesystem::path &path);
 
@@ -41,7 +382,9 @@ private:
 
     void remove_empty_directorys();
 
-    inline bool remove_file(const boost::filesystem::path &path);
+    bool remove_file(const FileNode &node, time_t expire = 0);
+
+    void remove_files(list<FileNode> &batch, time_t expire = 0);
 
     void sort();
 
@@ -50,16 +393,72 @@ private:
 private:
     // config
     string directory;
+    string real_directory;  // realpath(directory), 第一次 verify 时得到
     unsigned int limit;
     unsigned int safe;
     unsigned long timeout;
     bool emptydir;
+    bool locality;
+    size_t scan_budget;
+    bool path_time;
+    Reaper *reaper;
+    OpenFiles *open_files;
+    ScanCheckpoint *checkpoint;
+    bool rescan_enabled;
+    std::function<bool()> cancel;
 
     // stats
     unsigned long d_dir;
     unsigned long d_file;
 
+    // 本次扫描跳过的目录和文件
+    struct {
+        unsigned long vanished;     // 扫描时已被删除
+        unsigned long denied;       // 没有权限
+        unsigned long other;
+    } scan_errors;
+
+    // rescan
+    map<string, DirState> dir_states;
+    unsigned long rescans;
+    struct {
+        unsigned long read;         // 时间戳变化, 重新读取的目录
+        unsigned long unchanged;
+        unsigned long pruned;       // 已结束的日期目录, 跳过子目录
+        unsigned long skipped;      // 没有到访问时间的子目录树
+        unsigned long added;
+        unsigned long removed;
+    } rescan_stats;
+
+    // policy, nullptr: fifo
+    EvictionPolicy *policy;
+    struct {
+        unsigned long kept;         // 删除前发现新的访问, 重新排序
+        unsigned long hits;         // access() 的次数
+    } policy_stats;
+
+    // unlink-window
+    unsigned int unlink_window;
+    struct {
+        unsigned long runs;
+        unsigned long unlinks;      // 选出的文件数
+        unsigned long saved;        // 比按时间顺序少的文件数
+    } unlink_stats;
+
+    // fair share
+    Json::Value shares;
+    unsigned int share_depth;
+
     // queue
-    list <boost::filesystem::path> queue;
+    map<string, Subtree> subtrees;
+    size_t files;
+    DirTree *dirtree;       // 队列中文件的目录统计
+    FileIndex *index;       // dev+inode -> 队列中的位置, 大小为 hash-size
+    map<pair<dev_t, ino_t>, list<string>> links;    // 队列中文件的其他硬链接
     list <boost::filesystem::path> queue_empty_dir;
+    unsigned long generation;   // Subtree::version 的来源, 重建的子目录也不会重复
+
+    // plan
+    Mutex plan_mutex;
+    shared_ptr<const EvictionPlan> plan_snapshot;
 };
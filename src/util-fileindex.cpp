@@ -0,0 +1,103 @@
+//
+// Created by YANHAI on 2020/1/15.
+//
+
+#include "util-fileindex.h"
+
+using namespace std;
+
+#define FILE_INDEX_MIN_SIZE 64
+
+FileIndex::FileIndex(size_t hash_size)
+{
+    size_t size = FILE_INDEX_MIN_SIZE;
+    while (size < hash_size)
+        size <<= 1;
+    slots.resize(size, Slot{0, 0, nullptr, list<FileNode>::iterator()});
+    mask = size - 1;
+    count = 0;
+}
+
+size_t FileIndex::slot_of(dev_t dev, ino_t ino) const
+{
+    // splitmix64 finalizer, inode numbers are often sequential
+    uint64_t h = (uint64_t) ino ^ ((uint64_t) dev << 32 | (uint64_t) dev >> 32);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (size_t) h & mask;
+}
+
+FileIndex::Slot *FileIndex::find(dev_t dev, ino_t ino)
+{
+    for (size_t i = slot_of(dev, ino);; i = (i + 1) & mask) {
+        auto &slot = slots[i];
+        if (!slot.subtree)
+            return nullptr;
+        if (slot.dev == dev && slot.ino == ino)
+            return &slot;
+    }
+}
+
+bool FileIndex::insert(Subtree *subtree, list<FileNode>::iterator node)
+{
+    if ((count + 1) * 4 > slots.size() * 3)
+        grow();
+
+    size_t i = slot_of(node->dev, node->ino);
+    for (; slots[i].subtree; i = (i + 1) & mask) {
+        if (slots[i].dev == node->dev && slots[i].ino == node->ino)
+            return false;
+    }
+    slots[i] = Slot{node->dev, node->ino, subtree, node};
+    count++;
+    return true;
+}
+
+bool FileIndex::erase(dev_t dev, ino_t ino)
+{
+    size_t i = slot_of(dev, ino);
+    for (; slots[i].subtree; i = (i + 1) & mask) {
+        if (slots[i].dev == dev && slots[i].ino == ino)
+            break;
+    }
+    if (!slots[i].subtree)
+        return false;
+
+    // 后面同一探测序列中的元素前移, 不留下删除标记
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; slots[j].subtree; j = (j + 1) & mask) {
+        size_t home = slot_of(slots[j].dev, slots[j].ino);
+        // home 不在 (hole, j] 之间时可以移动到 hole
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole].subtree = nullptr;
+    count--;
+    return true;
+}
+
+void FileIndex::clear()
+{
+    for (auto &slot: slots)
+        slot.subtree = nullptr;
+    count = 0;
+}
+
+void FileIndex::grow()
+{
+    vector<Slot> old;
+    old.swap(slots);
+    slots.resize(old.size() * 2, Slot{0, 0, nullptr, list<FileNode>::iterator()});
+    mask = slots.size() - 1;
+    count = 0;
+
+    for (auto &slot: old) {
+        if (slot.subtree)
+            insert(slot.subtree, slot.node);
+    }
+}
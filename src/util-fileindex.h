@@ -0,0 +1,60 @@
+//
+// Created by YANHAI on 2020/1/15.
+//
+
+#pragma once
+
+#include <vector>
+#include "util-file.h"
+
+/**
+ * \brief Files in the FileCtx queues indexed by device and inode
+ *
+ * Open addressing with linear probing and backward shift deletion (no tombstones), the table
+ * starts at hash-size slots and doubles when it is 3/4 full.
+ * A slot keeps the position of the file in its subtree queue, std::list iterators stay valid
+ * when other files are inserted or removed, so the owner only has to update the index when the
+ * file itself moves.
+ */
+class FileIndex {
+public:
+    struct Slot {
+        dev_t dev;
+        ino_t ino;
+        Subtree *subtree;       // nullptr: empty slot
+        list<FileNode>::iterator node;
+    };
+
+    explicit FileIndex(size_t hash_size);
+
+    Slot *find(dev_t dev, ino_t ino);
+
+    /**
+     * \retval false if the file is already indexed, the index is not changed
+     */
+    bool insert(Subtree *subtree, list<FileNode>::iterator node);
+
+    bool erase(dev_t dev, ino_t ino);
+
+    void clear();
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t capacity() const
+    {
+        return slots.size();
+    }
+
+private:
+    size_t slot_of(dev_t dev, ino_t ino) const;
+
+    void grow();
+
+private:
+    vector<Slot> slots;
+    size_t mask;
+    size_t count;
+};
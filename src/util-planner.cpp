@@ -0,0 +1,248 @@
+//
+// Created by YANHAI on 2020/1/20.
+//
+
+#include <algorithm>
+#include <climits>
+#include "util-planner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PLANNER_HAVE_AVX2 1
+#endif
+
+using namespace std;
+
+#define SECTOR_SIZE 512
+
+/**
+ * 小于 t 的个数, 以及对应 sectors 的和. 没有分支, 列不要求有序
+ */
+static size_t count_below_scalar(const uint32_t *age, const uint32_t *sectors, size_t n, uint32_t t,
+                                 uint64_t *sum)
+{
+    size_t count = 0;
+    uint64_t s = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t m = age[i] < t;
+        count += m;
+        s += sectors[i] & (0 - m);
+    }
+    *sum = s;
+    return count;
+}
+
+static void prefix_sum_scalar(const uint32_t *in, uint64_t *out, size_t n)
+{
+    uint64_t s = 0;
+    for (size_t i = 0; i < n; i++) {
+        s += in[i];
+        out[i] = s;
+    }
+}
+
+#ifdef PLANNER_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static size_t count_below_avx2(const uint32_t *age, const uint32_t *sectors, size_t n, uint32_t t, uint64_t *sum)
+{
+    // 没有无符号比较, 两边都减去 2^31 后按有符号比较
+    const __m256i bias = _mm256_set1_epi32(INT_MIN);
+    const __m256i limit = _mm256_xor_si256(_mm256_set1_epi32((int) t), bias);
+    __m256i count = _mm256_setzero_si256();
+    __m256i sum_lo = _mm256_setzero_si256();
+    __m256i sum_hi = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (age + i)), bias);
+        __m256i m = _mm256_cmpgt_epi32(limit, a);
+        count = _mm256_sub_epi32(count, m);
+        __m256i s = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (sectors + i)), m);
+        sum_lo = _mm256_add_epi64(sum_lo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(s)));
+        sum_hi = _mm256_add_epi64(sum_hi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(s, 1)));
+    }
+
+    uint32_t c[8];
+    uint64_t s[4];
+    _mm256_storeu_si256((__m256i *) c, count);
+    _mm256_storeu_si256((__m256i *) s, _mm256_add_epi64(sum_lo, sum_hi));
+
+    uint64_t tail;
+    size_t r = count_below_scalar(age + i, sectors + i, n - i, t, &tail);
+    for (auto v: c)
+        r += v;
+    *sum = s[0] + s[1] + s[2] + s[3] + tail;
+    return r;
+}
+
+__attribute__((target("avx2")))
+static void prefix_sum_avx2(const uint32_t *in, uint64_t *out, size_t n)
+{
+    __m256i carry = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        // [a, b, c, d] -> [a, a+b, c, c+d] -> [a, a+b, a+b+c, a+b+c+d]
+        __m256i x = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *) (in + i)));
+        x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+        __m256i low = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 1, 1, 1));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_setzero_si256(), low, 0xF0));
+        x = _mm256_add_epi64(x, carry);
+        _mm256_storeu_si256((__m256i *) (out + i), x);
+        carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+
+    uint64_t s = i ? out[i - 1] : 0;
+    for (; i < n; i++) {
+        s += in[i];
+        out[i] = s;
+    }
+}
+
+static bool has_avx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#else
+
+static bool has_avx2()
+{
+    return false;
+}
+
+#endif
+
+static size_t count_below(const uint32_t *age, const uint32_t *sectors, size_t n, uint32_t t, uint64_t *sum)
+{
+#ifdef PLANNER_HAVE_AVX2
+    if (has_avx2())
+        return count_below_avx2(age, sectors, n, t, sum);
+#endif
+    return count_below_scalar(age, sectors, n, t, sum);
+}
+
+static void prefix_sum(const uint32_t *in, uint64_t *out, size_t n)
+{
+#ifdef PLANNER_HAVE_AVX2
+    if (has_avx2())
+        return prefix_sum_avx2(in, out, n);
+#endif
+    prefix_sum_scalar(in, out, n);
+}
+
+const char *EvictionPlan::kernel()
+{
+    return has_avx2() ? "avx2" : "scalar";
+}
+
+shared_ptr<const EvictionPlan::Columns> EvictionPlan::build(const string &name, unsigned long version,
+                                                            const list<FileNode> &queue)
+{
+    auto columns = make_shared<Columns>();
+    columns->name = name;
+    columns->version = version;
+    columns->base = 0;
+    columns->last = 0;
+    if (queue.empty())
+        return columns;
+
+    // 队列基本有序但不保证 (path-time 的文件 stat 后时间会变早)
+    time_t base = queue.front().mtime;
+    time_t last = base;
+    for (auto &node: queue) {
+        base = std::min(base, node.mtime);
+        last = std::max(last, node.mtime);
+    }
+    columns->base = base;
+    columns->last = last;
+
+    auto n = queue.size();
+    columns->age.reserve(n);
+    columns->sectors.reserve(n);
+    for (auto &node: queue) {
+        columns->age.push_back((uint32_t) std::min((time_t) UINT32_MAX, node.mtime - base));
+        columns->sectors.push_back((uint32_t) std::min((off_t) UINT32_MAX, (node.gain() + SECTOR_SIZE - 1) / SECTOR_SIZE));
+    }
+    columns->prefix.resize(n);
+    prefix_sum(columns->sectors.data(), columns->prefix.data(), n);
+    return columns;
+}
+
+/**
+ * 相对 base 的时间, 限制在 [0, UINT32_MAX]
+ */
+static uint32_t relative(time_t t, time_t base)
+{
+    if (t <= base)
+        return 0;
+    return (uint32_t) std::min((time_t) UINT32_MAX, t - base);
+}
+
+EvictionPlan::Summary EvictionPlan::older(time_t before) const
+{
+    Summary summary{0, 0, 0};
+    for (auto &part: parts) {
+        auto &c = *part.columns;
+        uint64_t sectors;
+        auto n = c.age.size() - part.head;
+        if (n == 0)
+            continue;
+        summary.files += count_below(c.age.data() + part.head, c.sectors.data() + part.head, n,
+                                     relative(before, c.base), &sectors);
+        summary.bytes += (off_t) sectors * SECTOR_SIZE;
+    }
+    return summary;
+}
+
+EvictionPlan::Summary EvictionPlan::cut(off_t bytes) const
+{
+    Summary summary{0, 0, 0};
+    const Part *single = nullptr;
+    time_t first = 0;
+    time_t last = 0;
+    unsigned int active = 0;
+
+    for (auto &part: parts) {
+        auto &c = *part.columns;
+        if (part.head >= c.age.size())
+            continue;
+        if (active++ == 0 || c.base < first)
+            first = c.base;
+        last = std::max(last, c.last);
+        single = &part;
+    }
+    if (active == 0 || bytes <= 0)
+        return summary;
+
+    // 一个子目录: 按队列顺序, 前缀和中二分查找
+    if (active == 1) {
+        auto &c = *single->columns;
+        uint64_t done = single->head ? c.prefix[single->head - 1] : 0;
+        uint64_t target = done + ((uint64_t) bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        auto it = std::lower_bound(c.prefix.begin() + single->head, c.prefix.end(), target);
+        if (it == c.prefix.end())
+            --it;
+        auto i = (size_t) (it - c.prefix.begin());
+        summary.files = i - single->head + 1;
+        summary.bytes = (off_t) (*it - done) * SECTOR_SIZE;
+        summary.newest = c.base + c.age[i];
+        return summary;
+    }
+
+    // 多个子目录: 最小的时间 t, 使 t 之前(包括 t)的文件释放足够的空间
+    time_t lo = first;
+    time_t hi = last;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (older(mid + 1).bytes >= bytes)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    summary = older(lo + 1);
+    summary.newest = lo;
+    return summary;
+}
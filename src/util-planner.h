@@ -0,0 +1,79 @@
+//
+// Created by YANHAI on 2020/1/20.
+//
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "util-file.h"
+
+/**
+ * \brief Column-wise snapshot of the eviction queues, answers planning questions without
+ *        walking the queues: how much is older than a time, how many files free N bytes
+ *
+ * Each subtree queue is copied into contiguous columns in queue (eviction) order: 32 bit mtimes
+ * relative to the oldest file, sizes in 512 byte sectors (32 bits cover 2TB per file, st_blocks
+ * is in sectors anyway) and their prefix sums. Position i in the columns is the i-th file of the
+ * queue, the queue keeps the paths.
+ * The columns are immutable once built. Files taken from the head of a queue only move the
+ * head of the next snapshot, any other change rebuilds the columns of that subtree.
+ * A snapshot is built by the worker thread and may be queried by any thread.
+ *
+ * Threshold counts and prefix sums run on AVX2 when the cpu has it.
+ * Files of path-time directories not stat'ed yet count as 0 bytes.
+ */
+class EvictionPlan {
+public:
+    struct Columns {
+        string name;                // subtree
+        unsigned long version;      // Subtree::version the columns were built from
+        time_t base;                // mtime of age 0
+        time_t last;                // newest mtime
+        vector<uint32_t> age;       // mtime - base
+        vector<uint32_t> sectors;   // FileNode::gain() / 512
+        vector<uint64_t> prefix;    // prefix[i]: sectors of files 0..i
+    };
+
+    struct Part {
+        shared_ptr<const Columns> columns;
+        size_t head;                // files already taken from the queue
+    };
+
+    struct Summary {
+        size_t files;
+        off_t bytes;
+        time_t newest;              // cut(): mtime of the newest file taken, 0 if none
+    };
+
+    explicit EvictionPlan(vector<Part> parts) : parts(std::move(parts))
+    {}
+
+    /**
+     * \brief Copy a subtree queue into columns
+     */
+    static shared_ptr<const Columns> build(const string &name, unsigned long version, const list<FileNode> &queue);
+
+    /**
+     * \brief Files modified before a time, in all subtrees
+     */
+    Summary older(time_t before) const;
+
+    /**
+     * \brief Oldest files (by mtime over all subtrees) that free at least bytes
+     *
+     * One subtree is a binary search of the prefix sums, several subtrees a binary search of the
+     * cut time using older().
+     */
+    Summary cut(off_t bytes) const;
+
+    const vector<Part> &subtrees() const
+    {
+        return parts;
+    }
+
+    static const char *kernel();
+
+private:
+    vector<Part> parts;
+};
@@ -0,0 +1,133 @@
+//
+// Created by YANHAI on 2020/1/24.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util-policy.h"
+#include "util/log.h"
+
+#define GDSF_PAGE 4096.0            // size unit of gdsf, smaller files count as one page
+#define ACCESS_DRAIN_MAX 65536      // events read per drain, the rest waits for the next loop
+
+/**
+ * lru: 最后一次访问(或修改)的时间
+ */
+class LruPolicy : public EvictionPolicy {
+public:
+    const char *name() const override
+    {
+        return "lru";
+    }
+
+    double priority(const FileNode &node) const override
+    {
+        return (double) std::max(node.atime, node.mtime);
+    }
+};
+
+/**
+ * gdsf: GreedyDual-Size-Frequency, H = L + F / S
+ * F 为访问次数 + 1, S 为占用的页数, L 为最近删除的文件的 H. 访问越多, 越小的文件保留越久,
+ * L 随删除增长, 新放入和刚访问的文件排在长时间没有访问的文件之后
+ */
+class GdsfPolicy : public EvictionPolicy {
+public:
+    GdsfPolicy() : inflation(0)
+    {}
+
+    const char *name() const override
+    {
+        return "gdsf";
+    }
+
+    double priority(const FileNode &node) const override
+    {
+        // path-time 的文件大小未知, 排在最前, 删除前 stat 后重新排序
+        if (node.coarse)
+            return inflation;
+        return inflation + (1.0 + node.hits) / std::max(1.0, (double) node.alloc / GDSF_PAGE);
+    }
+
+    void evicted(const FileNode &node) override
+    {
+        inflation = std::max(inflation, node.priority);
+    }
+
+private:
+    double inflation;
+};
+
+EvictionPolicy *EvictionPolicy::create(const string &name, bool &known)
+{
+    known = true;
+    if (name == "lru")
+        return new LruPolicy();
+    if (name == "gdsf")
+        return new GdsfPolicy();
+    known = name.empty() || name == "fifo";
+    return nullptr;
+}
+
+AccessEvents::AccessEvents(const string &path) : path(path), fd(-1), self(getpid()), overflows(0)
+{}
+
+AccessEvents::~AccessEvents()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool AccessEvents::open()
+{
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fd < 0) {
+        spdlog::warn("fanotify for {}: {}", path, strerror(errno));
+        return false;
+    }
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_CLOSE_NOWRITE, AT_FDCWD, path.c_str()) != 0) {
+        spdlog::warn("fanotify mark mount of {}: {}", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    spdlog::info("watch read accesses on the mount of {}", path);
+    return true;
+}
+
+size_t AccessEvents::drain(const function<void(dev_t, ino_t)> &hit)
+{
+    alignas(struct fanotify_event_metadata) char buf[8192];
+    struct stat st;
+    size_t events = 0;
+
+    while (fd >= 0 && events < ACCESS_DRAIN_MAX) {
+        auto len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR)
+                spdlog::warn("fanotify read for {}: {}", path, strerror(errno));
+            break;
+        }
+
+        auto *event = (struct fanotify_event_metadata *) buf;
+        for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            events++;
+            if (event->mask & FAN_Q_OVERFLOW) {
+                if (overflows++ == 0)
+                    spdlog::warn("fanotify queue for {} overflowed, accesses lost", path);
+                continue;
+            }
+            if (event->fd < 0)
+                continue;
+            if (event->pid != self && fstat(event->fd, &st) == 0 && S_ISREG(st.st_mode))
+                hit(st.st_dev, st.st_ino);
+            close(event->fd);
+        }
+    }
+    return events;
+}
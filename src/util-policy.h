@@ -0,0 +1,74 @@
+//
+// Created by YANHAI on 2020/1/24.
+//
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include "util-file.h"
+
+using namespace std;
+
+/**
+ * \brief Which file of a subtree is deleted first when space runs out
+ *
+ * fifo (no policy object) deletes in queue order, by mtime. The other policies rank files by
+ * priority(), FileCtx keeps each subtree's files in a set ordered by it, the lowest goes first.
+ * Timeout deletion and the plan stay in mtime order.
+ */
+class EvictionPolicy {
+public:
+    virtual ~EvictionPolicy() = default;
+
+    /**
+     * @param name fifo, lru or gdsf
+     * @param known false for an unknown name
+     * @return nullptr for fifo
+     */
+    static EvictionPolicy *create(const string &name, bool &known);
+
+    virtual const char *name() const = 0;
+
+    /**
+     * \brief Rank of a file, computed when it enters the ordered set or after an access
+     */
+    virtual double priority(const FileNode &node) const = 0;
+
+    /**
+     * \brief A file ranked by this policy was deleted for space
+     */
+    virtual void evicted(const FileNode &)
+    {}
+};
+
+/**
+ * \brief Read accesses on the mount of a path from fanotify (FAN_CLOSE_NOWRITE), needs CAP_SYS_ADMIN
+ *
+ * A file counts as accessed when a reader closes it. Opens by auto_clean itself (compress) are
+ * ignored. Events of files outside the path arrive as well and are dropped by the caller.
+ */
+class AccessEvents {
+public:
+    explicit AccessEvents(const string &path);
+
+    ~AccessEvents();
+
+    /**
+     * @return false if fanotify is not available, logged
+     */
+    bool open();
+
+    /**
+     * \brief Read the pending events without blocking, hit is called for each read file
+     * @return number of events
+     */
+    size_t drain(const function<void(dev_t, ino_t)> &hit);
+
+private:
+    string path;
+    int fd;
+    pid_t self;
+    unsigned long overflows;
+};
@@ -0,0 +1,172 @@
+//
+// Created by YANHAI on 2020/1/18.
+//
+
+#include <cerrno>
+#include <csignal>
+#include <sys/signalfd.h>
+#include "util-reactor.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define REACTOR_MAX_EVENTS  32
+#define REACTOR_TIMER_TAG   (1ULL << 32)    // epoll data of timers, the fd is in the low 32 bits
+
+Reactor &Reactor::instance()
+{
+    static Reactor reactor;
+    return reactor;
+}
+
+Reactor::Reactor()
+{
+    wakeups = 0;
+    signal_fd = -1;
+    stopped = false;
+    MutexInit(&timers_mutex, nullptr);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        spdlog::error("epoll_create failed: {}", strerror(errno));
+}
+
+Reactor::~Reactor()
+{
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    MutexDestroy(&timers_mutex);
+}
+
+bool Reactor::watch(int fd, uint32_t events, Handler handler)
+{
+    struct epoll_event ev;
+
+    if (epoll_fd < 0)
+        return false;
+
+    ev.events = events;
+    ev.data.u64 = (uint64_t) fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        spdlog::error("epoll add fd {} failed: {}", fd, strerror(errno));
+        return false;
+    }
+    handlers[fd] = handler;
+    return true;
+}
+
+void Reactor::unwatch(int fd)
+{
+    if (handlers.erase(fd))
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool Reactor::signals(const vector<int> &signos, function<void(int)> handler)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    for (auto signo: signos)
+        sigaddset(&mask, signo);
+
+    // 不阻塞的话信号还是按默认方式处理, signalfd 读不到
+    int r = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    if (r != 0) {
+        spdlog::error("block signals failed: {}", strerror(r));
+        return false;
+    }
+
+    signal_fd = signalfd(signal_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        spdlog::error("signalfd failed: {}", strerror(errno));
+        return false;
+    }
+
+    int fd = signal_fd;
+    return watch(fd, EPOLLIN, [fd, handler](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info))
+            handler((int) info.ssi_signo);
+    });
+}
+
+bool Reactor::attach(int timer_fd, int event_fd)
+{
+    struct epoll_event ev;
+
+    if (epoll_fd < 0)
+        return false;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = REACTOR_TIMER_TAG | (uint32_t) timer_fd;
+
+    MutexLock(&timers_mutex);
+    bool ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == 0;
+    if (ok)
+        timers[timer_fd] = event_fd;
+    MutexUnlock(&timers_mutex);
+
+    if (!ok)
+        spdlog::error("epoll add timer fd {} failed: {}", timer_fd, strerror(errno));
+    return ok;
+}
+
+void Reactor::detach(int timer_fd)
+{
+    // 持有锁时删除, 返回后 loop 不会再写这个 eventfd, 调用者可以关闭它们
+    MutexLock(&timers_mutex);
+    if (timers.erase(timer_fd))
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, timer_fd, nullptr);
+    MutexUnlock(&timers_mutex);
+}
+
+void Reactor::expire(int timer_fd)
+{
+    uint64_t n;
+
+    MutexLock(&timers_mutex);
+    auto it = timers.find(timer_fd);
+    // fd 可能已经 detach 并被复用, 没有到期时 read 返回 EAGAIN
+    if (it != timers.end() && read(timer_fd, &n, sizeof(n)) == sizeof(n)) {
+        uint64_t one = 1;
+        if (write(it->second, &one, sizeof(one)) < 0)
+            spdlog::warn("wake up thread failed: {}", strerror(errno));
+    }
+    MutexUnlock(&timers_mutex);
+}
+
+int Reactor::run()
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (epoll_fd < 0)
+        return -1;
+
+    while (!stopped) {
+        int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            spdlog::error("epoll_wait failed: {}", strerror(errno));
+            return -1;
+        }
+        wakeups++;
+
+        for (int i = 0; i < n; i++) {
+            int fd = (int) (uint32_t) events[i].data.u64;
+            if (events[i].data.u64 & REACTOR_TIMER_TAG) {
+                expire(fd);
+                continue;
+            }
+            // 前面的 handler 可能已经 unwatch 了这个 fd
+            auto it = handlers.find(fd);
+            if (it != handlers.end()) {
+                auto handler = it->second;
+                handler(events[i].events);
+            }
+        }
+    }
+    return 0;
+}
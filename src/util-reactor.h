@@ -0,0 +1,80 @@
+//
+// Created by YANHAI on 2020/1/18.
+//
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <vector>
+#include <sys/epoll.h>
+#include "util-threads.h"
+
+/**
+ * \brief epoll event loop of the main thread
+ *
+ * Signals arrive through a signalfd, the thread deadlines are timerfds owned by the threads:
+ * when one expires the reactor writes the eventfd the thread waits on. Nothing wakes up while
+ * there is nothing to do.
+ *
+ * watch(), signals(), run() and stop() are for the main thread only, the handlers run on it
+ * without any lock held and may take their time. attach()/detach() may be called by any
+ * thread, threads are created and freed by other threads.
+ */
+class Reactor {
+public:
+    typedef std::function<void(uint32_t events)> Handler;
+
+    static Reactor &instance();
+
+    bool valid() const
+    {
+        return epoll_fd >= 0;
+    }
+
+    bool watch(int fd, uint32_t events, Handler handler);
+
+    void unwatch(int fd);
+
+    /**
+     * \brief Block the signals in the calling thread and handle them in the loop instead
+     *
+     * Must be called before any other thread is created, threads inherit the signal mask.
+     */
+    bool signals(const std::vector<int> &signos, std::function<void(int signo)> handler);
+
+    /**
+     * \brief Forward expirations of timer_fd to event_fd
+     */
+    bool attach(int timer_fd, int event_fd);
+
+    void detach(int timer_fd);
+
+    /**
+     * \brief Run until stop() is called by a handler
+     */
+    int run();
+
+    void stop()
+    {
+        stopped = true;
+    }
+
+    // stats
+    unsigned long long wakeups;
+
+private:
+    Reactor();
+    ~Reactor();
+
+    void expire(int timer_fd);
+
+private:
+    int epoll_fd;
+    int signal_fd;
+    bool stopped;
+    std::map<int, Handler> handlers;
+
+    Mutex timers_mutex;
+    std::map<int, int> timers;      // timer_fd -> event_fd
+};
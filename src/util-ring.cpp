@@ -0,0 +1,143 @@
+//
+// Created by YANHAI on 2020/1/23.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util-ring.h"
+#include "util/log.h"
+
+using namespace std;
+
+#define RING_STALL_SECONDS  10      // a claimed slot not published for so long is logged
+
+NotifyRing::NotifyRing(const string &path, uint32_t capacity) : file(path)
+{
+    // 向上取整到 2 的幂
+    size = 1;
+    while (size < capacity && size < (1u << 30))
+        size <<= 1;
+    ring.header = nullptr;
+    ring.records = nullptr;
+    ring.length = 0;
+    stall_pos = 0;
+    stall_since = 0;
+    stall_logged = false;
+}
+
+NotifyRing::~NotifyRing()
+{
+    ac_ring_close(&ring);
+}
+
+bool NotifyRing::open()
+{
+    // 容量相同时继续使用, 保留没有读取的记录
+    if (ac_ring_open(&ring, file.c_str()) == 0) {
+        if (ring.header->capacity == size) {
+            // 上次退出时记录已读取但 tail 还没有更新
+            auto &tail = ring.header->tail;
+            if (ring.records[tail & (size - 1)].seq == tail + size)
+                tail++;
+            spdlog::info("notify ring {}: {} records, {} unread", file, size,
+                         __atomic_load_n(&ring.header->head, __ATOMIC_ACQUIRE) - tail);
+            return true;
+        }
+        ac_ring_close(&ring);
+    }
+    return create();
+}
+
+bool NotifyRing::create()
+{
+    auto length = ac_ring_length(size);
+
+    // 新的文件, 仍映射旧文件的生产者不会看到不完整的 ring
+    unlink(file.c_str());
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        spdlog::error("create notify ring {} failed: {}", file, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, (off_t) length) != 0) {
+        spdlog::error("resize notify ring {} failed: {}", file, strerror(errno));
+        close(fd);
+        unlink(file.c_str());
+        return false;
+    }
+    auto header = (ac_ring_header *) mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        spdlog::error("map notify ring {} failed: {}", file, strerror(errno));
+        unlink(file.c_str());
+        return false;
+    }
+
+    header->version = AC_RING_VERSION;
+    header->capacity = size;
+    header->record_size = sizeof(ac_ring_record);
+    header->dropped = 0;
+    header->head = 0;
+    header->tail = 0;
+    auto records = (ac_ring_record *) (header + 1);
+    for (uint32_t i = 0; i < size; i++)
+        records[i].seq = i;
+    __atomic_store_n(&header->magic, AC_RING_MAGIC, __ATOMIC_RELEASE);
+
+    ring.header = header;
+    ring.records = records;
+    ring.length = length;
+    spdlog::info("notify ring {} created: {} records, {} bytes", file, size, length);
+    return true;
+}
+
+size_t NotifyRing::drain(const std::function<void(const ac_ring_record &)> &consume)
+{
+    if (!ring.header)
+        return 0;
+
+    auto header = ring.header;
+    uint64_t pos = header->tail;
+    size_t n = 0;
+    ac_ring_record record;
+
+    while (n < size) {
+        auto &slot = ring.records[pos & (size - 1)];
+        if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+
+        // 复制后立即还给生产者, 路径来自其他进程, 不信任 path_len
+        memcpy(&record, &slot, sizeof(record));
+        __atomic_store_n(&slot.seq, pos + size, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->tail, ++pos, __ATOMIC_RELEASE);
+        record.path[std::min(record.path_len, (uint32_t) AC_RING_PATH_MAX - 1)] = '\0';
+        consume(record);
+        n++;
+    }
+
+    // 生产者占用了位置但一直没有发布(如写入记录时退出), 后面的记录都无法读取
+    if (n == 0 && __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) > pos) {
+        auto now = std::time(nullptr);
+        if (pos != stall_pos || stall_since == 0) {
+            stall_pos = pos;
+            stall_since = now;
+            stall_logged = false;
+        } else if (!stall_logged && now - stall_since >= RING_STALL_SECONDS) {
+            spdlog::error("notify ring {}: record {} claimed but not published for {}s, producer died?",
+                          file, pos, now - stall_since);
+            stall_logged = true;
+        }
+    } else {
+        stall_since = 0;
+    }
+    return n;
+}
+
+uint64_t NotifyRing::dropped() const
+{
+    return ring.header ? __atomic_load_n(&ring.header->dropped, __ATOMIC_RELAXED) : 0;
+}
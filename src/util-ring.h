@@ -0,0 +1,66 @@
+//
+// Created by YANHAI on 2020/1/23.
+//
+
+#pragma once
+
+#include <ctime>
+#include <functional>
+#include <string>
+#include "auto_clean_ring.h"
+
+using namespace std;
+
+/**
+ * \brief Consumer side of a producer notification ring (auto_clean_ring.h) in shared memory
+ *
+ * Created by the worker of a clean entry, producers map the same file. The ring and its
+ * unread records survive a restart of auto_clean when the capacity is unchanged, otherwise
+ * the file is replaced; producers still mapping the old one write into an unlinked file.
+ * A producer that dies between claiming and publishing a slot stops the ring at that slot,
+ * which is logged; files are then found by rescans only.
+ */
+class NotifyRing {
+public:
+    NotifyRing(const string &path, uint32_t capacity);
+
+    ~NotifyRing();
+
+    /**
+     * \brief Create or reuse the ring file
+     * @return false on failure, logged
+     */
+    bool open();
+
+    const string &path() const
+    {
+        return file;
+    }
+
+    uint32_t capacity() const
+    {
+        return size;
+    }
+
+    /**
+     * \brief Read the published records in order, at most one lap of the ring
+     * @return records read
+     */
+    size_t drain(const std::function<void(const ac_ring_record &)> &consume);
+
+    /**
+     * \brief Records dropped by producers since the ring was created
+     */
+    uint64_t dropped() const;
+
+private:
+    bool create();
+
+private:
+    string file;
+    uint32_t size;
+    ac_ring ring;
+    uint64_t stall_pos;     // slot claimed but not published
+    time_t stall_since;
+    bool stall_logged;
+};
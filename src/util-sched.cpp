@@ -0,0 +1,195 @@
+//
+// Created by YANHAI on 2020/1/13.
+//
+
+#include <cerrno>
+#include <cstdlib>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "util-sched.h"
+#include "util/log.h"
+
+using namespace std;
+
+/* glibc has no wrapper for ioprio_set, see linux/ioprio.h */
+#define IOPRIO_CLASS_NONE       0
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_PRIO_VALUE(class, data)  (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS      1
+
+#define IOPRIO_BE_DEFAULT       4
+
+SchedPolicy::SchedPolicy()
+{
+    ioprio_class = IOPRIO_CLASS_NONE;
+    ioprio_level = 0;
+    idle = false;
+    has_nice = false;
+    nice = 0;
+}
+
+static bool parse_int(const string &s, int min, int max, int &value)
+{
+    char *end = nullptr;
+
+    if (s.empty())
+        return false;
+    long v = strtol(s.c_str(), &end, 10);
+    if (*end != '\0' || v < min || v > max)
+        return false;
+    value = (int) v;
+    return true;
+}
+
+bool SchedPolicy::parse(const string &ioprio, const string &sched, const string &affinity)
+{
+    SchedPolicy p;
+
+    if (ioprio == "idle") {
+        p.ioprio_class = IOPRIO_CLASS_IDLE;
+    } else if (ioprio == "be") {
+        p.ioprio_class = IOPRIO_CLASS_BE;
+        p.ioprio_level = IOPRIO_BE_DEFAULT;
+    } else if (ioprio.compare(0, 3, "be:") == 0) {
+        p.ioprio_class = IOPRIO_CLASS_BE;
+        if (!parse_int(ioprio.substr(3), 0, 7, p.ioprio_level)) {
+            spdlog::error("invalid ioprio level: {}", ioprio);
+            return false;
+        }
+    } else if (!ioprio.empty()) {
+        spdlog::error("invalid ioprio: {}, should be idle or be:N", ioprio);
+        return false;
+    }
+
+    if (sched == "idle") {
+        p.idle = true;
+    } else if (sched.compare(0, 5, "nice:") == 0) {
+        p.has_nice = true;
+        if (!parse_int(sched.substr(5), -20, 19, p.nice)) {
+            spdlog::error("invalid nice value: {}", sched);
+            return false;
+        }
+    } else if (sched == "normal") {
+        p.has_nice = true;
+    } else if (!sched.empty()) {
+        spdlog::error("invalid sched: {}, should be idle, normal or nice:N", sched);
+        return false;
+    }
+
+    // 0-3,6
+    size_t pos = 0;
+    while (pos < affinity.length()) {
+        size_t end = affinity.find(',', pos);
+        if (end == string::npos)
+            end = affinity.length();
+        string range = affinity.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        int first, last;
+        if (!parse_int(range.substr(0, dash), 0, CPU_SETSIZE - 1, first) ||
+            !parse_int(dash == string::npos ? range : range.substr(dash + 1), first, CPU_SETSIZE - 1, last)) {
+            spdlog::error("invalid cpu-affinity: {}", affinity);
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            p.cpus.push_back(cpu);
+        pos = end + 1;
+    }
+
+    *this = p;
+    return true;
+}
+
+struct ProcessSched {
+    int ioprio;
+    int policy;
+    int nice;
+    cpu_set_t cpus;
+};
+
+/**
+ * 进程启动时的设置 (例如 ionice, nice, taskset 指定), 线程没有配置的项恢复为它们
+ */
+static const ProcessSched &process_sched()
+{
+    static ProcessSched defaults = []() {
+        ProcessSched d;
+        d.ioprio = (int) syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, getpid());
+        if (d.ioprio < 0)
+            d.ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+        d.policy = sched_getscheduler(getpid());
+        if (d.policy != SCHED_IDLE)
+            d.policy = SCHED_OTHER;     // real time policies are not inherited by cleaner threads
+        CPU_ZERO(&d.cpus);
+        if (sched_getaffinity(getpid(), sizeof(d.cpus), &d.cpus) != 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, &d.cpus);
+        }
+        errno = 0;
+        d.nice = getpriority(PRIO_PROCESS, (id_t) getpid());
+        if (errno != 0)
+            d.nice = 0;
+        return d;
+    }();
+    return defaults;
+}
+
+void SchedPolicy::apply(const string &name) const
+{
+    auto tid = (pid_t) syscall(SYS_gettid);
+
+    int value = process_sched().ioprio;
+    if (ioprio_class != IOPRIO_CLASS_NONE)
+        value = IOPRIO_PRIO_VALUE(ioprio_class, ioprio_class == IOPRIO_CLASS_BE ? ioprio_level : 0);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, value) != 0)
+        spdlog::warn("{}: set ioprio {} failed: {}", name, value, strerror(errno));
+
+    int policy = idle ? SCHED_IDLE : has_nice ? SCHED_OTHER : process_sched().policy;
+    struct sched_param param = {0};
+    if (sched_setscheduler(tid, policy, &param) != 0)
+        spdlog::warn("{}: set sched {} failed: {}", name, policy == SCHED_IDLE ? "idle" : "normal", strerror(errno));
+    int n = has_nice ? nice : process_sched().nice;
+    if (policy != SCHED_IDLE && setpriority(PRIO_PROCESS, (id_t) tid, n) != 0)
+        spdlog::warn("{}: set nice {} failed: {}", name, n, strerror(errno));
+
+    cpu_set_t set = process_sched().cpus;
+    if (!cpus.empty()) {
+        CPU_ZERO(&set);
+        for (auto cpu: cpus)
+            CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(tid, sizeof(set), &set) != 0)
+        spdlog::warn("{}: set cpu affinity failed: {}", name, strerror(errno));
+
+    spdlog::debug("{}: {}", name, str());
+}
+
+bool SchedPolicy::empty() const
+{
+    return ioprio_class == IOPRIO_CLASS_NONE && !idle && !has_nice && cpus.empty();
+}
+
+string SchedPolicy::str() const
+{
+    string s = "ioprio ";
+    if (ioprio_class == IOPRIO_CLASS_IDLE)
+        s += "idle";
+    else if (ioprio_class == IOPRIO_CLASS_BE)
+        s += "be:" + std::to_string(ioprio_level);
+    else
+        s += "default";
+
+    if (idle)
+        s += ", sched idle";
+    else if (has_nice)
+        s += ", nice " + std::to_string(nice);
+
+    if (!cpus.empty()) {
+        s += ", cpus";
+        for (size_t i = 0; i < cpus.size(); i++)
+            s += (i ? "," : " ") + std::to_string(cpus[i]);
+    }
+    return s;
+}
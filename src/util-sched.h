@@ -0,0 +1,52 @@
+//
+// Created by YANHAI on 2020/1/13.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * \brief I/O priority, cpu scheduling and cpu affinity of a thread
+ *
+ * All of them are per thread on linux, apply() must be called by the thread itself.
+ * Fields not given are reset to what the process was started with, so applying a policy
+ * always gives the same result whatever was applied before.
+ */
+class SchedPolicy {
+public:
+    SchedPolicy();
+
+    /**
+     * \brief Parse the options of a config entry
+     *
+     * @param ioprio   "idle", "be" or "be:N" (N 0-7, 0 is the highest), "" for default
+     * @param sched    "idle" (SCHED_IDLE), "nice:N" or "normal" (nice 0), "" for default
+     * @param affinity cpu list like "0-3,6", "" for all cpus of the process
+     * \retval false if any of them is invalid, the policy is not changed
+     */
+    bool parse(const string &ioprio, const string &sched, const string &affinity);
+
+    /**
+     * \brief Apply to the calling thread, failures are logged and ignored
+     */
+    void apply(const string &name) const;
+
+    /**
+     * \brief Nothing configured, the thread runs as the process was started
+     */
+    bool empty() const;
+
+    string str() const;
+
+private:
+    int ioprio_class;   // IOPRIO_CLASS_NONE, _BE or _IDLE
+    int ioprio_level;
+    bool idle;          // SCHED_IDLE
+    bool has_nice;      // false: nice of the process
+    int nice;
+    vector<int> cpus;   // empty: all cpus of the process
+};
@@ -5,7 +5,13 @@
 
 #include <iostream>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "util-threads.h"
+#include "util-reactor.h"
+
+#define THREAD_WAIT_SLACK 1   // seconds past the timer before timedWait returns by itself
 
 
 /* root of the threadvars list */
@@ -25,69 +31,82 @@ ThreadVars::ThreadVars()
     /** slot functions */
     sleep = 0;     // seconds
 //    cout << "ThreadVars()" << endl;
-    initMC();
+    initWakeup();
 }
 
 ThreadVars::~ThreadVars()
 {
 //    cout << "~ThreadVars()" << endl;
-    deinitMC();
+    deinitWakeup();
 }
 
 /**
- * \brief Initializes the mutex and condition variables for this TV
- *
- * It can be used by a thread to control a wait loop that can also be
- * influenced by other threads.
+ * \brief Creates the eventfd the thread waits on and its deadline timer
  *
- * \param tv Pointer to a TV instance
+ * The timerfd is watched by the reactor of the main thread, which writes the eventfd when
+ * it expires. Without the reactor the thread falls back to a poll() timeout.
  */
-void ThreadVars::initMC()
+void ThreadVars::initWakeup()
 {
-    if ( (ctrl_mutex = (CtrlMutex *)malloc(sizeof(CtrlMutex))) == nullptr) {
-        cout << "Fatal error encountered in TmThreadInitMC. Exiting..." << endl;
-        exit(EXIT_FAILURE);
-    }
-
-    if (CtrlMutexInit(ctrl_mutex, nullptr) != 0) {
-        cout << "Error initializing the tv->m mutex" << endl;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        cout << "Error creating the thread eventfd: " << strerror(errno) << endl;
         exit(EXIT_FAILURE);
     }
 
-    if ( (ctrl_cond = (CtrlCondT *)malloc(sizeof(CtrlCondT))) == nullptr) {
-        cout << "Fatal error encountered in TmThreadInitMC. Exiting..." << endl;
-        exit(EXIT_FAILURE);
-    }
-
-    if (CtrlCondInit(ctrl_cond, nullptr) != 0) {
-        cout << "Error initializing the tv->cond condition variable" << endl;
-        exit(EXIT_FAILURE);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd >= 0 && !Reactor::instance().attach(timer_fd, event_fd)) {
+        close(timer_fd);
+        timer_fd = -1;
     }
 }
 
-void ThreadVars::deinitMC()
+void ThreadVars::deinitWakeup()
 {
-    if (ctrl_mutex) {
-        CtrlMutexDestroy(ctrl_mutex);
-        free(ctrl_mutex);
-    }
-    if (ctrl_cond) {
-        CtrlCondDestroy(ctrl_cond);
-        free(ctrl_cond);
+    if (timer_fd >= 0) {
+        Reactor::instance().detach(timer_fd);
+        close(timer_fd);
     }
+    close(event_fd);
 }
 
-void ThreadVars::ctrlCondTimedwait(time_t t)
+/**
+ * \brief Waits t seconds (at least 1) or until wakeup() is called,
+ *        if wakeup() was called since the last wait it returns at once
+ */
+void ThreadVars::timedWait(time_t t)
 {
-    struct timespec cond_time;
-
-    cond_time.tv_sec = time(nullptr) + t + 1;
-    cond_time.tv_nsec = 0;
+    struct itimerspec its;
+    struct pollfd pfd = {event_fd, POLLIN, 0};
+    uint64_t n;
+
+    if (t <= 0)
+        t = 1;
+
+    memset(&its, 0, sizeof(its));
+    if (timer_fd >= 0) {
+        its.it_value.tv_sec = t;
+        timerfd_settime(timer_fd, 0, &its, nullptr);
+        // 定时器由主线程的 reactor 转发, 主线程忙(如 reload 时等待线程退出)时自己超时
+        while (poll(&pfd, 1, (int) (t + THREAD_WAIT_SLACK) * 1000) < 0 && errno == EINTR);
+        // 提前被唤醒时取消定时器, 避免之后多一次唤醒
+        its.it_value.tv_sec = 0;
+        timerfd_settime(timer_fd, 0, &its, nullptr);
+    } else {
+        poll(&pfd, 1, (int) t * 1000);
+    }
 
-    //sleep(sleep);
-    CtrlMutexLock(ctrl_mutex);
-    CtrlCondTimedwait(ctrl_cond, ctrl_mutex, &cond_time);
-    CtrlMutexUnlock(ctrl_mutex);
+    if (read(event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        cout << "Error reading the thread eventfd: " << strerror(errno) << endl;
 }
 
-
+/**
+ * \brief Wake up the thread if it is waiting in timedWait,
+ *        if it is busy the next timedWait returns at once
+ */
+void ThreadVars::wakeup()
+{
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        cout << "Error waking up thread '" << name << "': " << strerror(errno) << endl;
+}
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/prctl.h>
+#include "util-sched.h"
 
 
 using namespace std;
@@ -175,9 +176,18 @@ public:
         }
     }
 
-    void initMC();
-    void deinitMC();
-    void ctrlCondTimedwait(time_t t);
+    void initWakeup();
+    void deinitWakeup();
+    void timedWait(time_t t);
+    void wakeup();
+
+    /**
+     * \brief eventfd written by wakeup(), for threads waiting in their own poll()
+     */
+    int wakeupFd() const
+    {
+        return event_fd;
+    }
 
     virtual int init() = 0;
     virtual int loop() = 0;
@@ -190,10 +200,11 @@ public:
 
     unsigned int flags;
     unsigned int sleep;     // seconds
+    SchedPolicy sched_policy;   // set by init(), applied once the thread is named
 
 private:
-    CtrlMutex *ctrl_mutex;
-    CtrlCondT *ctrl_cond;
+    int event_fd;   // readable when woken up, by wakeup() or by the reactor when timer_fd expires
+    int timer_fd;   // deadline of timedWait(), -1 if the reactor is not available
 
     ThreadVars *next;
     ThreadVars *prev;
@@ -0,0 +1,141 @@
+//
+// Created by YANHAI on 2020/1/21.
+//
+
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <json/json.h>
+#include "util-trace.h"
+#include "util-threads.h"
+#include "util/log.h"
+
+using namespace std;
+
+struct TraceEvent {
+    const char *name;
+    uint64_t begin;     // us
+    uint64_t end;
+    pid_t tid;
+    string arg;
+};
+
+static Mutex trace_lock = MUTEX_INITIALIZER;
+static string trace_path;
+static vector<TraceEvent> ring;
+static size_t ring_next = 0;        // 下一个写入的位置
+static bool ring_full = false;
+static map<pid_t, string> thread_names;
+
+atomic<bool> Trace::on(false);
+
+void Trace::enable(const string &path, size_t capacity)
+{
+    MutexLock(&trace_lock);
+    trace_path = path;
+    ring.assign(capacity ? capacity : 1, TraceEvent{nullptr, 0, 0, 0, string()});
+    ring_next = 0;
+    ring_full = false;
+    MutexUnlock(&trace_lock);
+    on = true;
+    spdlog::info("trace {} events per ring to {}", capacity, path);
+}
+
+uint64_t Trace::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Trace::record(const char *name, uint64_t begin, uint64_t end, const string *arg)
+{
+    static thread_local pid_t tid = 0;
+    bool first = tid == 0;
+    if (first)
+        tid = (pid_t) syscall(SYS_gettid);
+
+    MutexLock(&trace_lock);
+    // 线程名在 init 之后才设置, 第一个事件一定在 loop 中
+    if (first) {
+        char thread_name[THREAD_NAME_LEN + 1] = "";
+        prctl(PR_GET_NAME, thread_name, 0, 0, 0);
+        thread_names[tid] = thread_name;
+    }
+    auto &e = ring[ring_next];
+    e.name = name;
+    e.begin = begin;
+    e.end = end;
+    e.tid = tid;
+    if (arg)
+        e.arg = *arg;
+    else
+        e.arg.clear();
+    if (++ring_next == ring.size()) {
+        ring_next = 0;
+        ring_full = true;
+    }
+    MutexUnlock(&trace_lock);
+}
+
+bool Trace::dump()
+{
+    vector<TraceEvent> events;
+    map<pid_t, string> names;
+
+    if (!enabled())
+        return false;
+
+    // 复制后再生成 JSON, 不阻塞记录事件的线程
+    MutexLock(&trace_lock);
+    size_t count = ring_full ? ring.size() : ring_next;
+    size_t start = ring_full ? ring_next : 0;
+    events.reserve(count);
+    for (size_t i = 0; i < count; i++)
+        events.push_back(ring[(start + i) % ring.size()]);
+    names = thread_names;
+    auto path = trace_path;
+    MutexUnlock(&trace_lock);
+
+    Json::Value root;
+    auto &trace_events = root["traceEvents"];
+    auto pid = (Json::Int) getpid();
+    for (auto &it: names) {
+        Json::Value meta;
+        meta["name"] = "thread_name";
+        meta["ph"] = "M";
+        meta["pid"] = pid;
+        meta["tid"] = (Json::Int) it.first;
+        meta["args"]["name"] = it.second;
+        trace_events.append(meta);
+    }
+    for (auto &e: events) {
+        Json::Value event;
+        event["name"] = e.name;
+        event["ph"] = "X";
+        event["ts"] = (Json::UInt64) e.begin;
+        event["dur"] = (Json::UInt64) (e.end - e.begin);
+        event["pid"] = pid;
+        event["tid"] = (Json::Int) e.tid;
+        if (!e.arg.empty())
+            event["args"]["path"] = e.arg;
+        trace_events.append(event);
+    }
+    root["displayTimeUnit"] = "ms";
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    ofstream out(path, ios::trunc);
+    if (out)
+        out << Json::writeString(builder, root) << endl;
+    if (!out) {
+        spdlog::error("write trace file {} failed", path);
+        return false;
+    }
+    spdlog::info("{} trace events written to {}", events.size(), path);
+    return true;
+}
@@ -0,0 +1,84 @@
+//
+// Created by YANHAI on 2020/1/21.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * USDT probes, provider auto_clean. Without sys/sdt.h they compile to nothing, with it a probe
+ * is a nop until bpftrace/perf attaches, e.g.
+ *     bpftrace -e 'usdt:/usr/bin/auto_clean:auto_clean:dir__read { @[str(arg0)] = count(); }'
+ *
+ * scan__start(dir)                     scan__end(dir, files, usec)
+ * dir__read(dir, entries)              unlink__batch(files, expire)
+ * evict__plan(bytes, planned_bytes)    disk__probe(path, used_percent)
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, ...)  STAP_PROBEV(auto_clean, name, ##__VA_ARGS__)
+#else
+#define TRACE_PROBE(name, ...)  do {} while (0)
+#endif
+
+/**
+ * \brief Phase spans of all threads kept in a bounded ring, written as Chrome trace JSON
+ *        (chrome://tracing, ui.perfetto.dev) for offline flame charts
+ *
+ * Disabled unless --trace-file is given, a span then costs one relaxed atomic load.
+ * The ring keeps the newest events, older ones are overwritten.
+ */
+class Trace {
+public:
+    static void enable(const std::string &path, size_t capacity);
+
+    static bool enabled()
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief monotonic clock in microseconds
+     */
+    static uint64_t now();
+
+    static void record(const char *name, uint64_t begin, uint64_t end, const std::string *arg);
+
+    /**
+     * \brief Write the ring to the trace file, events stay in the ring
+     */
+    static bool dump();
+
+private:
+    static std::atomic<bool> on;
+};
+
+/**
+ * \brief A phase of the calling thread, from construction to destruction
+ *
+ * arg (e.g. a directory) is copied only when the span is recorded, it must outlive the span.
+ */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, const std::string *arg = nullptr)
+            : name(name), arg(arg), begin(Trace::enabled() ? Trace::now() : 0)
+    {}
+
+    ~TraceSpan()
+    {
+        if (begin)
+            Trace::record(name, begin, Trace::now(), arg);
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    const std::string *arg;
+    uint64_t begin;
+};
@@ -2,6 +2,9 @@
 // Created by YANHAI on 2019/12/30.
 //
 
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <string>
 #include "config.h"
@@ -21,13 +24,29 @@ bool Config::load_config(const string &filename)
     }
 
     JSONCPP_STRING errs;
-    if (!parseFromStream(builder, is, &root, &errs)) {
+    Json::Value value;
+    if (!parseFromStream(builder, is, &value, &errs)) {
         spdlog::error("{}: parse {} failed: {}", __FUNCTION__, filename, errs);
         return false;
     }
+
+    this->filename = filename;
+    root.swap(value);
     return true;
 }
 
+bool Config::reload_config()
+{
+    if (filename.empty()) {
+        spdlog::error("{}: config was never loaded", __FUNCTION__);
+        return false;
+    }
+
+    // 拷贝一份, load_config 会修改 filename
+    auto file = filename;
+    return load_config(file);
+}
+
 Json::UInt64 Config::time_string_to_uint64(Json::Value &s)
 {
     Json::UInt64 val = 0;
@@ -60,3 +79,83 @@ Json::UInt64 Config::time_string_to_uint64(Json::Value &s)
 
     return val;
 }
+
+/**
+ * 解析 "512", "64K", "256M", "4G", "1T" 格式的大小, 单位为字节. 只允许数字和一个单位, 不抛出异常
+ */
+bool Config::size_string_to_uint64(const Json::Value &s, Json::UInt64 &val)
+{
+    if (s.isNull()) {
+        val = 0;
+        return true;
+    }
+    if (s.isIntegral()) {
+        if (!s.isUInt64())
+            return false;
+        val = s.asUInt64();
+        return true;
+    }
+    if (!s.isString())
+        return false;
+
+    auto size_str = s.asString();
+    if (size_str.empty()) {
+        val = 0;
+        return true;
+    }
+
+    // strtoull 接受前导空白和负号, 第一个字符必须是数字
+    const char *p = size_str.c_str();
+    if (!isdigit((unsigned char) p[0]))
+        return false;
+    char *end;
+    errno = 0;
+    Json::UInt64 v = strtoull(p, &end, 10);
+    if (errno == ERANGE)
+        return false;
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case 't':
+        case 'T':
+            shift = 40;
+            break;
+        default:
+            break;
+    }
+    if (shift)
+        end++;
+    if (*end != '\0' || v > (UINT64_MAX >> shift))
+        return false;
+
+    val = v << shift;
+    return true;
+}
+
+std::string Config::list_to_string(const Json::Value &s)
+{
+    if (s.isNull())
+        return "";
+    if (!s.isArray())
+        return s.asString();
+
+    std::string list;
+    for (auto &item: s) {
+        if (!list.empty())
+            list += ",";
+        list += item.asString();
+    }
+    return list;
+}
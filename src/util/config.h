@@ -23,8 +23,29 @@ public:
 
     static Json::UInt64 time_string_to_uint64(Json::Value &s);
 
+    /**
+     * \brief A size in bytes given as number or as "512", "64K", "256M", "4G", "1T"
+     *
+     * null and "" are 0
+     * \retval false on anything else (negative, trailing text, overflow), val is unchanged
+     */
+    static bool size_string_to_uint64(const Json::Value &s, Json::UInt64 &val);
+
+    /**
+     * \brief A list given as array or as comma separated string, e.g. [0, 2] and "0,2"
+     *
+     * \retval the comma separated string
+     */
+    static std::string list_to_string(const Json::Value &s);
+
     bool load_config(const std::string &config_file);
 
+    /**
+     * \brief Re-read the config file given to load_config().
+     *        The current config is kept untouched if the new one can not be parsed.
+     */
+    bool reload_config();
+
     Json::Value &operator[](const char *key)
     {
         return root[key];
@@ -46,5 +67,6 @@ public:
     }
 
 private:
+    std::string filename;
     Json::Value root;
 };
@@ -3,15 +3,27 @@
 //
 
 #include <iostream>
+#include <set>
 #include <util/config.h>
+#include <boost/timer/timer.hpp>
 #include "worker.h"
+#include "tm-threads.h"
+#include "util-planner.h"
+#include "util-trace.h"
 #include "util/log.h"
 
 using namespace std;
 
+#define BALLAST_DEFAULT_CRITICAL 99    // percent, release the ballast when critical is not set
+#define RING_DEFAULT_SIZE 16384         // records of a notify ring, 512 bytes each
+#define PLAN_KEEP 60                    // seconds the plan is kept up to date after a query
+
 int Worker::_worker_threads = 0;
+Mutex Worker::workers_lock = MUTEX_INITIALIZER;
+list<Worker *> Worker::workers;
+atomic<int> Worker::plan_notify_fd(-1);
 
-Worker::Worker(Json::Value &config) : config(config)
+Worker::Worker(const Json::Value &config) : config(config), reload_config(config)
 {
     _worker_threads++;
     name = "Work";
@@ -19,12 +31,52 @@ Worker::Worker(Json::Value &config) : config(config)
     sleep = 3;
     file = nullptr;
     disk = nullptr;
+    reaper = nullptr;
+    open_files = nullptr;
+    open_deleted = 0;
+    compressor = nullptr;
+    ballast = nullptr;
+    compress_age = 0;
+    rescan_interval = 0;
+    last_scan = 0;
+    scanned = false;
+    ring = nullptr;
+    ring_dropped = 0;
+    access_events = nullptr;
+    plan_queried = 0;
+    plan_builds = 0;
+    plan_wanted = false;
+    critical = 0;
+    escalated = false;
+    reload_pending = false;
+    MutexInit(&reload_mutex, nullptr);
+    MutexInit(&reserve_mutex, nullptr);
+
+    MutexLock(&workers_lock);
+    workers.push_back(this);
+    MutexUnlock(&workers_lock);
 }
 
 Worker::~Worker()
 {
+    MutexLock(&workers_lock);
+    workers.remove(this);
+    MutexUnlock(&workers_lock);
+
+    _worker_threads--;
+    if (escalated && reaper)
+        Reaper::escalate(reaper, false);
+    Reaper::forget(this);
+    delete compressor;
+    delete ring;
+    delete access_events;
     delete file;
     delete disk;
+
+    for (auto &r: reservations)
+        r->complete(RESERVE_FAILED, 0, "worker stopped");
+    MutexDestroy(&reserve_mutex);
+    MutexDestroy(&reload_mutex);
 }
 
 int Worker::init()
@@ -37,31 +89,388 @@ int Worker::init()
     unsigned int limit = config["limit"].asUInt();
     unsigned int safe = config["safe"].asUInt();
     bool emptydir = config["empty"].asBool();
-    file = new FileCtx(path, limit, safe, timeout, emptydir);
+    MutexLock(&workers_lock);
+    file = new FileCtx(path, limit, safe, timeout, emptydir, config["hash-size"].asUInt());
+    MutexUnlock(&workers_lock);
+    file->set_cancel([this]() { return checkFlag(THV_KILL) != 0; });
     disk = new Disk(path.c_str(), limit);
+    setup();
     return 0;
 }
 
+/**
+ * 应用可以在运行中修改的选项, init 和 reload 时调用
+ */
+void Worker::setup()
+{
+    // 先恢复, 下次 loop 时按新的配置重新判断
+    if (escalated) {
+        if (reaper)
+            Reaper::escalate(reaper, false);
+        escalated = false;
+    }
+
+    // ioprio/sched/cpu-affinity: 默认和进程相同, 超过 critical 时切换到 critical-ioprio/critical-sched.
+    // 在创建压缩线程之前设置, 压缩线程继承它
+    const string &affinity = Config::list_to_string(config["cpu-affinity"]);
+    SchedPolicy policy;
+    if (policy.parse(config["ioprio"].asString(), config["sched"].asString(), affinity))
+        sched_policy = policy;
+    else
+        spdlog::warn("{}: invalid scheduling options, keep {}", name, sched_policy.str());
+    if (policy.parse(config.get("critical-ioprio", "be:0").asString(),
+                     config.get("critical-sched", "normal").asString(), affinity))
+        critical_policy = policy;
+    critical = (short) config["critical"].asUInt();
+    sched_policy.apply(name);
+
+    // staged-delete: 删除的文件先移动到挂载点的回收站, 由 reaper 在后台释放
+    reaper = nullptr;
+    if (config["staged-delete"].asBool()) {
+        const char *mount_point = disk->MountPoint();
+        if (mount_point)
+            reaper = Reaper::instance(mount_point);
+        if (!reaper)
+            spdlog::warn("{}: no reaper for {}, delete files directly", name, config["path"].asString());
+    }
+    file->set_reaper(reaper);
+
+    // inode-limit/inode-safe: inode 使用率(df -i)达到 inode-limit 时按文件数删除到 inode-safe
+    auto inode_limit = (short) config["inode-limit"].asUInt();
+    disk->setInodeThreshold(inode_limit, (short) config.get("inode-safe", std::max(inode_limit - 1, 0)).asUInt());
+
+    // ballast: 挂载点上预分配的文件, 达到 critical 时立即释放, 低于 safe 后重新分配
+    Json::UInt64 ballast_size = 0;
+    if (!Config::size_string_to_uint64(config["ballast"], ballast_size)) {
+        spdlog::warn("{}: invalid ballast size, keep the current ballast", name);
+    } else {
+        if (ballast)
+            ballast->configure(name, 0);
+        ballast = nullptr;
+    }
+    if (ballast_size > 0) {
+        const char *mount_point = disk->MountPoint();
+        if (mount_point) {
+            ballast = Ballast::instance(mount_point);
+            ballast->configure(name, (off_t) ballast_size,
+                               critical > 0 ? critical : (short) BALLAST_DEFAULT_CRITICAL,
+                               (short) config["safe"].asUInt());
+        } else {
+            spdlog::warn("{}: no mount point for {}, ballast disabled", name, config["path"].asString());
+        }
+    }
+
+    file->set_locality(config["locality"].asBool());
+
+    // skip-open: 被生产者打开的文件(/proc/<pid>/fd)不删除, 删除后也不会释放空间
+    open_files = config["skip-open"].asBool() ? OpenFiles::instance() : nullptr;
+    file->set_open_files(open_files);
+
+    // scan-budget: 每个子目录只在内存中保留最旧的 N 个文件, 用完后重新扫描
+    Json::UInt64 scan_budget;
+    if (Config::size_string_to_uint64(config["scan-budget"], scan_budget))
+        file->set_scan_budget(scan_budget);
+    else
+        spdlog::warn("{}: invalid scan-budget, keep the current one", name);
+
+    // path-time: 按日期目录名得到文件时间, 扫描时不 stat 文件
+    file->set_path_time(config["path-time"].asBool());
+
+    // scan-checkpoint: 扫描中途退出后, 下次启动从停止的位置继续
+    file->set_checkpoint(config["scan-checkpoint"].asString());
+
+    // rescan: 每隔一段时间增量扫描, 只读取时间戳变化的目录, 发现完整扫描之后的新文件
+    Json::Value rescan = config.get("rescan", 0);
+    rescan_interval = Config::time_string_to_uint64(rescan);
+    file->set_rescan(rescan_interval > 0);
+
+    // ring: 生产者通过共享内存通知写入的文件, 直接放入队列, 扫描只用于定期核对 (rescan).
+    // 重新打开时容量不变则保留未读取的记录
+    delete ring;
+    ring = nullptr;
+    const string &ring_path = config["ring"].asString();
+    if (!ring_path.empty()) {
+        ring = new NotifyRing(ring_path, config.get("ring-size", RING_DEFAULT_SIZE).asUInt());
+        if (ring->open()) {
+            ring_dropped = ring->dropped();
+        } else {
+            delete ring;
+            ring = nullptr;
+        }
+    }
+
+    // policy: 空间不足时先删除哪个文件, fifo(修改时间), lru(访问时间), gdsf(访问次数和大小)
+    // access: atime(默认, 删除前 stat) 或 fanotify(读取文件后关闭时通知, 需要 root)
+    const string eviction = config.get("policy", "fifo").asString();
+    bool known = file->set_policy(eviction);
+    if (!known)
+        spdlog::warn("{}: unknown policy {}, use fifo", name, eviction);
+    bool ranked = known && !eviction.empty() && eviction != "fifo";
+    delete access_events;
+    access_events = nullptr;
+    if (eviction == "lru" || eviction == "gdsf") {
+        if (config["access"].asString() == "fanotify") {
+            access_events = new AccessEvents(config["path"].asString());
+            if (!access_events->open()) {
+                delete access_events;
+                access_events = nullptr;
+            }
+        }
+        if (!access_events && disk->noatime())
+            spdlog::warn("{}: {} is mounted noatime, policy {} sees no accesses", name,
+                         config["path"].asString(), eviction);
+    }
+
+    // shares: 子目录按权重分配空间, 空间不足时先删除超出份额最多的子目录
+    auto &shares = config["shares"];
+    auto share_depth = config.get("share-depth", shares.isObject() ? 1 : 0).asUInt();
+    file->set_shares(shares, share_depth);
+
+    // unlink-window: 空间不足时在最旧的 N% 的文件中用最少的 unlink 释放空间, 大文件先删除
+    auto unlink_window = config["unlink-window"].asUInt();
+    file->set_unlink_window(std::min(unlink_window, 100u));
+    if (unlink_window > 0 && (eviction != "fifo" || share_depth > 0))
+        spdlog::warn("{}: unlink-window only applies to policy fifo without shares, ignored", name);
+
+    // plan 在所有子目录上按修改时间从旧到新切分, 这些选项下实际删除的文件不同, 查询结果标记为近似
+    Json::Value approximate(Json::arrayValue);
+    if (share_depth > 0)
+        approximate.append("shares");
+    if (ranked)
+        approximate.append("policy " + eviction);
+    else if (unlink_window > 0 && share_depth == 0)
+        approximate.append("unlink-window");
+    MutexLock(&workers_lock);
+    plan_approximate = approximate;
+    MutexUnlock(&workers_lock);
+
+    // action: compress, 超过 compress-age 的文件压缩为 .zst, 空间不足时仍然删除
+    bool compress = config["action"].asString() == "compress";
+    unsigned int threads = config.get("compress-threads", 2).asUInt();
+    unsigned int queue_size = config.get("compress-queue", 64).asUInt();
+    int level = config.get("compress-level", 3).asInt();
+    if (compressor && (!compress || !compressor->match(threads, queue_size, level))) {
+        compressor->stop();
+        file->compress_collect(compressor);
+        compressor->printStats();
+        delete compressor;
+        compressor = nullptr;
+    }
+    if (compress && !compressor) {
+        compressor = new Compressor(name, threads, queue_size, level);
+        if (compressor->start() != 0) {
+            spdlog::warn("{}: compress disabled, only delete files", name);
+            delete compressor;
+            compressor = nullptr;
+        }
+    }
+    if (compress) {
+        Json::Value age = config.get("compress-age", config["timeout"]);
+        compress_age = Config::time_string_to_uint64(age);
+    }
+
+}
+
+/**
+ * 磁盘使用率达到 critical 时提升本线程和 reaper 的优先级, 清理不再让路给生产者,
+ * 回落到 limit 以下后恢复
+ */
+void Worker::update_priority()
+{
+    if (critical <= 0 && !escalated)
+        return;
+
+    short used = disk->usedPercentage();
+    bool urgent = critical > 0 && (used >= critical || (escalated && used >= disk->threshold()));
+    if (urgent == escalated)
+        return;
+
+    escalated = urgent;
+    (escalated ? critical_policy : sched_policy).apply(name);
+    if (reaper)
+        Reaper::escalate(reaper, escalated);
+    spdlog::info("{}: disk used {}%, {} priority: {}", name, used,
+                 escalated ? "escalate" : "restore", (escalated ? critical_policy : sched_policy).str());
+}
+
+/**
+ * 生产者通知的文件放入队列, 通知丢失(ring 已满)时尽快 rescan
+ */
+void Worker::drain_ring()
+{
+    if (!ring)
+        return;
+
+    unsigned long added = 0;
+    unsigned long removed = 0;
+    unsigned long ignored = 0;
+    ring->drain([&](const ac_ring_record &r) {
+        bool ok = false;
+        if (r.type == AC_RING_REMOVED) {
+            ok = r.ino != 0 && file->forget((dev_t) r.dev, (ino_t) r.ino);
+            removed += ok;
+        } else if (r.type == AC_RING_CREATED || r.type == AC_RING_CLOSED) {
+            if (r.ino == 0)
+                ok = file->update(r.path);
+            else
+                ok = file->add(FileNode{r.path, (time_t) r.mtime, (off_t) r.size, (off_t) r.blocks * 512,
+                                        (dev_t) r.dev, (ino_t) r.ino, 1, 1, nullptr, false,
+                                        (time_t) r.mtime, 0, 0});
+            added += ok;
+        }
+        ignored += !ok;
+    });
+    if (added || removed || ignored)
+        spdlog::debug("{}: notify ring: {} files added, {} removed, {} ignored", name, added, removed, ignored);
+
+    auto dropped = ring->dropped();
+    if (dropped != ring_dropped) {
+        spdlog::warn("{}: notify ring {} was full, {} records dropped, {}", name, ring->path(),
+                     dropped - ring_dropped, rescan_interval > 0 ? "rescan now" : "set rescan to find the files");
+        ring_dropped = dropped;
+        last_scan = 0;
+    }
+}
+
+/**
+ * fanotify 的读取事件, 按 policy 重新排序. 不在队列中的文件(其他目录)忽略
+ */
+void Worker::drain_access()
+{
+    if (!access_events)
+        return;
+
+    unsigned long hits = 0;
+    auto now = std::time(nullptr);
+    auto events = access_events->drain([&](dev_t dev, ino_t ino) {
+        hits += file->access(dev, ino, now);
+    });
+    if (events)
+        spdlog::debug("{}: {} access events, {} files in the queue", name, events, hits);
+}
+
+/**
+ * 达到 critical 时释放 ballast, 给清理争取时间. 主线程的定时器也会检查, 这里在主线程忙时兜底
+ */
+void Worker::update_ballast()
+{
+    if (!ballast)
+        return;
+    ballast->update();
+}
+
+/**
+ * 应用 reload 后的配置, 只有 path 改变时才重建队列(需要重新扫描)
+ */
+void Worker::apply_config()
+{
+    MutexLock(&reload_mutex);
+    if (!reload_pending) {
+        MutexUnlock(&reload_mutex);
+        return;
+    }
+    config = reload_config;
+    reload_pending = false;
+    MutexUnlock(&reload_mutex);
+
+    sleep = config["sleep"].asUInt();
+    timeout = Config::time_string_to_uint64(config["timeout"]);
+
+    const string &path = config["path"].asString();
+    unsigned int limit = config["limit"].asUInt();
+    unsigned int safe = config["safe"].asUInt();
+    bool emptydir = config["empty"].asBool();
+
+    if (path != file->path()) {
+        spdlog::info("{}: path changed {} -> {}, rescan", name, file->path(), path);
+        delete compressor;
+        compressor = nullptr;
+        delete disk;
+        MutexLock(&workers_lock);
+        delete file;
+        file = new FileCtx(path, limit, safe, timeout, emptydir, config["hash-size"].asUInt());
+        MutexUnlock(&workers_lock);
+        disk = new Disk(path.c_str(), limit);
+        scanned = false;
+        setup();
+        return;
+    }
+
+    file->reconfigure(limit, safe, timeout, emptydir);
+    disk->setThreshold(limit);
+    setup();
+    spdlog::info("{}: config reloaded, limit: {} safe: {} timeout: {}s sleep: {}s",
+                 name, limit, safe, timeout, sleep);
+}
+
 int Worker::loop()
 {
-    if (file->empty()) {
-        file->recursive_directory();
-        if (file->empty())
+    TraceSpan span("loop", &name);
+    apply_config();
+    update_priority();
+    update_ballast();
+
+    if (file->exhausted()) {
+        // 启动时磁盘已满, 完整扫描可能需要几分钟, 先按日期目录顺序删除最旧的文件.
+        // 只在第一次完整扫描之前: 它不按 shares, policy, unlink-window 和 timeout 选择文件
+        if (!scanned && file->empty() && config["emergency"].asBool()) {
+            auto delete_bytes = disk->deleteBytes();
+            if (reaper)
+                delete_bytes -= reaper->pendingBytes();
+            if (delete_bytes > 0)
+                file->delete_for_emergency(delete_bytes);
+        }
+        if (!file->recursive_directory())
             return 0;
+        last_scan = std::time(nullptr);
+        scanned = true;
+    } else if (rescan_interval > 0 && std::time(nullptr) - last_scan >= (time_t) rescan_interval) {
+        file->rescan();
+        last_scan = std::time(nullptr);
+    }
+
+    drain_ring();
+    drain_access();
+    handle_reservations();
+    if (file->empty()) {
+        update_plan();
+        return 0;
     }
 
     auto delete_bytes = disk->deleteBytes();
+    if (reaper)
+        delete_bytes -= reaper->pendingBytes();  // 回收站中的文件很快会被释放
     if (delete_bytes > 0) {
         file->delete_for_limit(delete_bytes);
     }
 
+    // inode-limit: 大量小文件时 inode 先于空间用完, 按文件数删除
+    auto delete_files = disk->deleteInodes();
+    if (delete_files > 0)
+        file->delete_for_inodes(delete_files);
+
+    if (compressor && file->compress_for_age(compressor, compress_age) > 0)
+        compressor->printStats();
+
     file->delele_for_timeout();
+
+    // 已删除但仍被打开的文件, 关闭后才释放空间
+    if (open_files) {
+        auto bytes = open_files->deletedBytes(disk->device());
+        if (bytes != open_deleted)
+            spdlog::info("{}: {} bytes deleted but still open on the disk", name, bytes);
+        open_deleted = bytes;
+    }
+
+    update_plan();
     return 0;
 }
 
 void Worker::exitPrintStats()
 {
     spdlog::debug("Worker thread exit print stats: {}", name);
+    if (compressor)
+        compressor->printStats();
 }
 
 int Worker::deinit()
@@ -70,7 +479,265 @@ int Worker::deinit()
     return 0;
 }
 
-ThreadVars *Worker::create(Json::Value &config)
+ThreadVars *Worker::create(const Json::Value &config)
 {
     return new Worker(config);
 }
+
+void Worker::reconfigure(const Json::Value &config)
+{
+    MutexLock(&reload_mutex);
+    if (reload_config == config) {
+        MutexUnlock(&reload_mutex);
+        return;
+    }
+    reload_config = config;
+    reload_pending = true;
+    MutexUnlock(&reload_mutex);
+    wakeup();
+}
+
+void Worker::reload(const Json::Value &clean)
+{
+    set<string> names;
+
+    for (auto &WorkConfig: clean) {
+        const string &name = WorkConfig["name"].asString();
+        names.insert(name);
+
+        auto worker = dynamic_cast<Worker *>(TmThreads::lookup(name));
+        if (!WorkConfig["enabled"].asBool()) {
+            if (worker) {
+                spdlog::info("worker thread {} is disabled, retire it", name);
+                TmThreads::retire(worker);
+                Ballast::drop(name);
+            }
+            continue;
+        }
+
+        if (worker) {
+            worker->reconfigure(WorkConfig);
+            continue;
+        }
+
+        spdlog::info("worker thread {} is added", name);
+        ThreadVars *tv = Worker::create(WorkConfig);
+        if (TmThreads::spawn(tv) != 0) {
+            spdlog::error("TmThreadSpawn failed");
+            delete tv;
+        }
+    }
+
+    // 配置中已删除的 worker
+    list<ThreadVars *> retired;
+    TmThreads::foreach([&](ThreadVars *tv) {
+        if (dynamic_cast<Worker *>(tv) && !names.count(tv->name))
+            retired.push_back(tv);
+    });
+    for (auto tv: retired) {
+        auto name = tv->name;
+        spdlog::info("worker thread {} is removed", name);
+        TmThreads::retire(tv);
+        Ballast::drop(name);
+    }
+}
+
+/**
+ * 监控 path 的 worker, 调用时需要持有 workers_lock
+ */
+Worker *Worker::find(const string &path)
+{
+    Worker *worker = nullptr;
+    size_t len = 0;
+
+    for (auto w: workers) {
+        if (!w->file)
+            continue;
+        auto &dir = w->file->path();
+        if (dir.length() >= len && !path.compare(0, dir.length(), dir) &&
+            (path.length() == dir.length() || path[dir.length()] == '/')) {
+            worker = w;
+            len = dir.length();
+        }
+    }
+    return worker;
+}
+
+bool Worker::du(const string &path, unsigned int depth, Json::Value &result)
+{
+    MutexLock(&workers_lock);
+    auto worker = find(path);
+    bool r = worker && worker->file->du(path, depth, result);
+    if (r && worker->open_files)
+        result["deleted_open_bytes"] = (Json::Int64) worker->open_deleted;
+    MutexUnlock(&workers_lock);
+    return r;
+}
+
+/**
+ * plan 只在有查询时构建: 查询后 PLAN_KEEP 秒内每次 loop 更新, 之后释放快照, 平时不占用 loop 的时间
+ */
+void Worker::update_plan()
+{
+    time_t queried = plan_queried;
+    if (queried == 0)
+        return;
+    if (std::time(nullptr) - queried > PLAN_KEEP) {
+        if (plan_queried.compare_exchange_strong(queried, 0))
+            file->drop_plan();
+        return;
+    }
+
+    file->update_plan();
+    plan_builds++;
+
+    // 有查询在等待这次构建, 通知 control 线程
+    int fd = plan_notify_fd;
+    if (plan_wanted.exchange(false) && fd >= 0) {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) < 0)
+            spdlog::warn("{}: notify plan query failed: {}", name, strerror(errno));
+    }
+}
+
+bool Worker::plan_request(const string &path, bool &wait, unsigned long &builds)
+{
+    MutexLock(&workers_lock);
+    auto worker = find(path);
+    if (worker) {
+        // 快照没有在更新, 唤醒 worker 构建
+        auto now = std::time(nullptr);
+        wait = now - worker->plan_queried.exchange(now) > PLAN_KEEP;
+        builds = worker->plan_builds;
+        if (wait) {
+            worker->plan_wanted = true;
+            worker->wakeup();
+        }
+    }
+    MutexUnlock(&workers_lock);
+    return worker != nullptr;
+}
+
+bool Worker::plan_built(const string &path, unsigned long builds)
+{
+    MutexLock(&workers_lock);
+    auto worker = find(path);
+    bool built = !worker || worker->plan_builds != builds;
+    MutexUnlock(&workers_lock);
+    return built;
+}
+
+void Worker::set_plan_notify(int fd)
+{
+    plan_notify_fd = fd;
+}
+
+bool Worker::plan(const string &path, off_t bytes, unsigned long age, bool ready, Json::Value &result)
+{
+    shared_ptr<const EvictionPlan> plan;
+
+    MutexLock(&workers_lock);
+    auto worker = find(path);
+    if (worker) {
+        plan = worker->file->plan();
+        result["path"] = worker->file->path();
+        result["ready"] = ready;
+        result["exact"] = worker->plan_approximate.empty();
+        if (!worker->plan_approximate.empty())
+            result["approximate"] = worker->plan_approximate;
+    }
+    MutexUnlock(&workers_lock);
+    if (!plan)
+        return false;
+
+    // 在快照上查询, 不影响 worker
+    boost::timer::cpu_timer cpu_timer;
+    auto older = plan->older(time(nullptr) - (time_t) age);
+    auto cut = plan->cut(bytes);
+    cpu_timer.stop();
+
+    size_t files = 0;
+    for (auto &part: plan->subtrees())
+        files += part.columns->age.size() - part.head;
+    result["files"] = (Json::UInt64) files;
+    result["older"]["age"] = (Json::UInt64) age;
+    result["older"]["files"] = (Json::UInt64) older.files;
+    result["older"]["bytes"] = (Json::Int64) older.bytes;
+    result["cut"]["bytes"] = (Json::Int64) cut.bytes;
+    result["cut"]["files"] = (Json::UInt64) cut.files;
+    result["cut"]["newest"] = (Json::Int64) cut.newest;
+    result["kernel"] = EvictionPlan::kernel();
+    result["usec"] = (Json::UInt64) (cpu_timer.elapsed().wall / 1000);
+    return true;
+}
+
+bool Worker::reserve(const shared_ptr<Reservation> &r)
+{
+    MutexLock(&workers_lock);
+    auto worker = find(r->path);
+    if (worker) {
+        MutexLock(&worker->reserve_mutex);
+        worker->reservations.push_back(r);
+        MutexUnlock(&worker->reserve_mutex);
+        worker->wakeup();
+    }
+    MutexUnlock(&workers_lock);
+    return worker != nullptr;
+}
+
+/**
+ * 处理生产者的空间预留请求, 多个请求合并为一次删除:
+ * 删除到 可用空间 >= 请求的总大小 + limit 以上的余量
+ */
+void Worker::handle_reservations()
+{
+    list<shared_ptr<Reservation>> rs;
+    off_t bytes = 0;
+
+    MutexLock(&reserve_mutex);
+    rs.swap(reservations);
+    MutexUnlock(&reserve_mutex);
+
+    for (auto &r: rs) {
+        if (r->state == RESERVE_PENDING)
+            bytes += r->bytes;
+    }
+    if (bytes == 0)
+        return;
+
+    off_t target = bytes + disk->totalBytes() / 100 * (100 - disk->threshold());
+    off_t free = disk->freeBytes();
+    // 回收站中的文件很快会被释放, 不再为它们删除
+    off_t staged = reaper ? reaper->pendingBytes() : 0;
+    for (int pass = 0; free + staged < target && !file->empty() && pass < 8; pass++) {
+        file->delete_for_limit(target - free - staged);
+        free = disk->freeBytes();
+        staged = reaper ? reaper->pendingBytes() : 0;
+    }
+
+    // 回收站中的文件还没有释放: 放回队列, reaper 释放了一部分后唤醒, 在下一次 loop 中再检查
+    if (free < target && staged > 0 && !checkFlag(THV_KILL)) {
+        list<shared_ptr<Reservation>> waiting;
+        for (auto &r: rs) {
+            if (r->state == RESERVE_PENDING)
+                waiting.push_back(r);
+        }
+        if (!waiting.empty()) {
+            reaper->notify(this);
+            if (reaper->pendingBytes() < staged)
+                wakeup();   // 注册之前已经有进度
+            MutexLock(&reserve_mutex);
+            reservations.splice(reservations.begin(), waiting);
+            MutexUnlock(&reserve_mutex);
+            return;
+        }
+    }
+
+    spdlog::info("{}: reserve {} bytes for {} requests, {} bytes free", name, bytes, rs.size(), free);
+    for (auto &r: rs) {
+        if (free >= target)
+            r->complete(RESERVE_DONE, free, "");
+        else
+            r->complete(RESERVE_FAILED, free, "not enough space can be freed");
+    }
+}
@@ -9,10 +9,14 @@
 #include "util-threads.h"
 #include "util-file.h"
 #include "util-disk.h"
+#include "util-ring.h"
+#include "util-policy.h"
+#include "reaper.h"
+#include "control.h"
 
 class Worker : public ThreadVars {
 protected:
-    Worker(Json::Value &config);
+    Worker(const Json::Value &config);
 
 public:
     ~Worker();
@@ -25,7 +29,61 @@ public:
 
     virtual int deinit();
 
-    static ThreadVars *create(Json::Value &config);
+    static ThreadVars *create(const Json::Value &config);
+
+    /**
+     * \brief Hand a new config entry to a running worker.
+     *        It is applied by the worker thread itself at the start of its next loop.
+     */
+    void reconfigure(const Json::Value &config);
+
+    /**
+     * \brief Apply the "clean" entries of a reloaded config: unchanged entries are left alone,
+     *        changed ones are reconfigured in place, added or removed ones are spawned or retired.
+     */
+    static void reload(const Json::Value &clean);
+
+    /**
+     * \brief du of a path from the index of the worker watching it, called by other threads
+     */
+    static bool du(const string &path, unsigned int depth, Json::Value &result);
+
+    /**
+     * \brief A plan query for the worker watching a path, called by other threads
+     *
+     * The worker builds the plan only while queries arrive, for PLAN_KEEP seconds after the last
+     * one. When it is not kept up to date the worker is woken up to build it.
+     *
+     * @param wait set if the plan is being built, plan_built() tells when it is done and the
+     *        set_plan_notify() eventfd is written then
+     * @param builds plans built by the worker so far
+     * \retval false if no worker watches the path
+     */
+    static bool plan_request(const string &path, bool &wait, unsigned long &builds);
+
+    /**
+     * \brief A plan was built since plan_request() returned builds, or the worker is gone
+     */
+    static bool plan_built(const string &path, unsigned long builds);
+
+    static void set_plan_notify(int fd);
+
+    /**
+     * \brief Plan from the last snapshot of the worker watching a path, called by other threads
+     *
+     * result: files and bytes older than age seconds, and the oldest files that free bytes.
+     * The cut is by mtime over all subtrees, with shares, policy lru/gdsf or unlink-window the
+     * daemon evicts other files: exact is false and approximate names the options.
+     * @param ready false if the query stopped waiting before the plan was built
+     */
+    static bool plan(const string &path, off_t bytes, unsigned long age, bool ready, Json::Value &result);
+
+    /**
+     * \brief Queue a reservation to the worker watching its path and wake it up
+     *
+     * \retval false if no worker watches the path
+     */
+    static bool reserve(const shared_ptr<Reservation> &r);
 
     static int worker_threads()
     {
@@ -33,10 +91,65 @@ public:
     };
 
 private:
-    Json::Value &config;
+    void apply_config();
+
+    void setup();
+
+    void handle_reservations();
+
+    void update_priority();
+
+    void update_ballast();
+
+    void update_plan();
+
+    void drain_ring();
+
+    void drain_access();
+
+    static Worker *find(const string &path);
+
+private:
+    Json::Value config;
     unsigned long timeout;  // file timeout , will deleted
 
+    // reload, set by main thread
+    Mutex reload_mutex;
+    Json::Value reload_config;  // latest config given by main thread
+    bool reload_pending;
+
+    // reservations, queued by control thread
+    Mutex reserve_mutex;
+    list<shared_ptr<Reservation>> reservations;
+
     static int _worker_threads;
+
+    // all workers, for queries from other threads
+    static Mutex workers_lock;
+    static list<Worker *> workers;
+    static atomic<int> plan_notify_fd;  // eventfd of the control thread
+    atomic<time_t> plan_queried;    // last plan query, 0: the plan is not kept
+    atomic<unsigned long> plan_builds;
+    atomic<bool> plan_wanted;   // a query waits for the next build
+    Json::Value plan_approximate;   // options the plan does not follow, with workers_lock
     FileCtx *file;
     Disk *disk;
+    Reaper *reaper;
+    OpenFiles *open_files;      // skip-open
+    atomic<off_t> open_deleted; // last reported bytes of deleted but open files
+    Compressor *compressor;     // action: compress
+    unsigned long compress_age;
+    unsigned long rescan_interval;  // rescan, 0: only a full scan when the queue is used up
+    time_t last_scan;
+    bool scanned;               // a full scan of the path completed, no emergency deletion after it
+    NotifyRing *ring;           // files announced by producers
+    uint64_t ring_dropped;      // dropped records already reported
+    AccessEvents *access_events;    // access: fanotify, reads for policy lru/gdsf
+
+    Ballast *ballast;           // ballast of the mount, released at critical
+
+    // priority escalation, above critical until below limit
+    short critical;
+    SchedPolicy critical_policy;
+    bool escalated;
 };